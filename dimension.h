@@ -22,7 +22,11 @@
 #include <boost/date_time.hpp>
 #include <string>
 #include <map>
+#include <cstdint>
+#include <functional>
+#include <ostream>
 #include <stdexcept>
+#include <utility>
 
 namespace civita
 {
@@ -48,17 +52,156 @@ namespace civita
   template <> inline Dimension::Type dimensionTypeOf<boost::posix_time::ptime>() {return Dimension::time;} 
   template <> inline Dimension::Type dimensionTypeOf<double>() {return Dimension::value;}
 
+  /// A string held in a process wide pool of immutable strings, so
+  /// that copying, equality and hashing act on a 32 bit identifier
+  /// rather than the characters. Provides the read-only interface of
+  /// std::string; modifying operations (+=, assignment) intern the
+  /// resulting string. Ordering uses a table of the ranks of pooled
+  /// strings, rebuilt whenever the pool has doubled in size since it
+  /// was last built, falling back to comparing characters for
+  /// strings interned since.
+  ///
+  /// Lifetime: pooled strings are never freed, and remain valid (as
+  /// do references returned by str()) until the process exits. Memory
+  /// use therefore grows with the number of distinct labels ever
+  /// created, not with the number currently in use.
+  class InternedString
+  {
+    std::uint32_t m_id=0; // 0 is reserved for the empty string
+    static std::uint32_t intern(const std::string&);
+    static const std::string& lookup(std::uint32_t);
+    /// true if the string with id \a x sorts before that with id \a y
+    static bool less(std::uint32_t x, std::uint32_t y);
+  public:
+    using traits_type=std::string::traits_type;
+    using value_type=std::string::value_type;
+    using size_type=std::string::size_type;
+    using difference_type=std::string::difference_type;
+    using const_reference=std::string::const_reference;
+    using const_pointer=std::string::const_pointer;
+    using const_iterator=std::string::const_iterator;
+    using iterator=const_iterator;
+    using const_reverse_iterator=std::string::const_reverse_iterator;
+    using reverse_iterator=const_reverse_iterator;
+    static constexpr size_type npos=std::string::npos;
+    
+    InternedString() {}
+    InternedString(const std::string& x): m_id(intern(x)) {}
+    InternedString(const char* x): m_id(intern(x)) {}
+    /// identifier unique to this string's value
+    std::uint32_t id() const {return m_id;}
+    const std::string& str() const {return lookup(m_id);}
+    operator const std::string&() const {return str();}
+    const char* c_str() const {return str().c_str();}
+    const char* data() const {return str().data();}
+    size_type length() const {return str().length();}
+    size_type size() const {return str().size();}
+    size_type max_size() const {return str().max_size();}
+    bool empty() const {return m_id==0;}
+    char operator[](size_type i) const {return str()[i];}
+    char at(size_type i) const {return str().at(i);}
+    char front() const {return str().front();}
+    char back() const {return str().back();}
+    std::size_t hash() const {return std::hash<std::uint32_t>()(m_id);}
+
+    const_iterator begin() const {return str().begin();}
+    const_iterator end() const {return str().end();}
+    const_iterator cbegin() const {return str().cbegin();}
+    const_iterator cend() const {return str().cend();}
+    const_reverse_iterator rbegin() const {return str().rbegin();}
+    const_reverse_iterator rend() const {return str().rend();}
+    const_reverse_iterator crbegin() const {return str().crbegin();}
+    const_reverse_iterator crend() const {return str().crend();}
+
+    std::string substr(size_type pos=0, size_type n=npos) const {return str().substr(pos,n);}
+    size_type copy(char* dest, size_type n, size_type pos=0) const {return str().copy(dest,n,pos);}
+    // searches and compare forward to std::string's overloads
+    template <class... A> size_type find(A&&... a) const
+    {return str().find(std::forward<A>(a)...);}
+    template <class... A> size_type rfind(A&&... a) const
+    {return str().rfind(std::forward<A>(a)...);}
+    template <class... A> size_type find_first_of(A&&... a) const
+    {return str().find_first_of(std::forward<A>(a)...);}
+    template <class... A> size_type find_last_of(A&&... a) const
+    {return str().find_last_of(std::forward<A>(a)...);}
+    template <class... A> size_type find_first_not_of(A&&... a) const
+    {return str().find_first_not_of(std::forward<A>(a)...);}
+    template <class... A> size_type find_last_not_of(A&&... a) const
+    {return str().find_last_not_of(std::forward<A>(a)...);}
+    template <class... A> int compare(A&&... a) const
+    {return str().compare(std::forward<A>(a)...);}
+
+    InternedString& operator+=(const std::string& x) {return *this=str()+x;}
+    InternedString& operator+=(const char* x) {return *this=str()+x;}
+    InternedString& operator+=(char x) {return *this=str()+x;}
+    
+    bool operator==(const InternedString& x) const {return m_id==x.m_id;}
+    bool operator!=(const InternedString& x) const {return m_id!=x.m_id;}
+    bool operator<(const InternedString& x) const {return m_id!=x.m_id && less(m_id,x.m_id);}
+    bool operator<=(const InternedString& x) const {return m_id==x.m_id || less(m_id,x.m_id);}
+    bool operator>(const InternedString& x) const {return x<*this;}
+    bool operator>=(const InternedString& x) const {return x<=*this;}
+    // comparisons with unpooled strings, which avoid adding them to the pool
+    bool operator==(const std::string& x) const {return str()==x;}
+    bool operator!=(const std::string& x) const {return str()!=x;}
+    bool operator<(const std::string& x) const {return str()<x;}
+    bool operator<=(const std::string& x) const {return str()<=x;}
+    bool operator>(const std::string& x) const {return str()>x;}
+    bool operator>=(const std::string& x) const {return str()>=x;}
+    bool operator==(const char* x) const {return str()==x;}
+    bool operator!=(const char* x) const {return str()!=x;}
+    bool operator<(const char* x) const {return str()<x;}
+    bool operator<=(const char* x) const {return str()<=x;}
+    bool operator>(const char* x) const {return str()>x;}
+    bool operator>=(const char* x) const {return str()>=x;}
+  };
+
+  inline bool operator==(const std::string& x, const InternedString& y) {return y==x;}
+  inline bool operator!=(const std::string& x, const InternedString& y) {return y!=x;}
+  inline bool operator<(const std::string& x, const InternedString& y) {return y>x;}
+  inline bool operator<=(const std::string& x, const InternedString& y) {return y>=x;}
+  inline bool operator>(const std::string& x, const InternedString& y) {return y<x;}
+  inline bool operator>=(const std::string& x, const InternedString& y) {return y<=x;}
+  inline bool operator==(const char* x, const InternedString& y) {return y==x;}
+  inline bool operator!=(const char* x, const InternedString& y) {return y!=x;}
+  inline bool operator<(const char* x, const InternedString& y) {return y>x;}
+  inline bool operator<=(const char* x, const InternedString& y) {return y>=x;}
+  inline bool operator>(const char* x, const InternedString& y) {return y<x;}
+  inline bool operator>=(const char* x, const InternedString& y) {return y<=x;}
+  // concatenation yields an unpooled std::string
+  inline std::string operator+(const InternedString& x, const InternedString& y) {return x.str()+y.str();}
+  inline std::string operator+(const InternedString& x, const std::string& y) {return x.str()+y;}
+  inline std::string operator+(const std::string& x, const InternedString& y) {return x+y.str();}
+  inline std::string operator+(const InternedString& x, const char* y) {return x.str()+y;}
+  inline std::string operator+(const char* x, const InternedString& y) {return x+y.str();}
+  inline std::string operator+(const InternedString& x, char y) {return x.str()+y;}
+  inline std::string operator+(char x, const InternedString& y) {return x+y.str();}
+  inline std::ostream& operator<<(std::ostream& o, const InternedString& x) {return o<<x.str();}
+  
   /// a variant type representing a value of a dimension
   // TODO - when we move to c++17, consider using std::variant
   struct any
   {
     Dimension::Type type=Dimension::string;
-    boost::posix_time::ptime time;
-    double value=0;
-    std::string string;
+    InternedString string;
+  private:
+#ifdef CLASSDESC
+    CLASSDESC_ACCESS(any);
+#endif
+    /// only the member corresponding to type is valid. Both are
+    /// trivially copyable, so may share storage, which is why they
+    /// are only accessible via asTime() and asValue().
+    union
+    {
+      boost::posix_time::ptime time;
+      double value=0;
+    };
+    static_assert(std::is_trivially_copyable<boost::posix_time::ptime>::value,
+                  "ptime cannot share storage");
+  public:
     size_t hash() const;
-    any()=default;
-    any(Dimension::Type type): type(type) {}
+    any() {}
+    any(Dimension::Type type): type(type) {if (type==Dimension::time) time={};}
     any(const boost::posix_time::ptime& x): type(Dimension::time), time(x) {}
     any(const std::string& x): type(Dimension::string), string(x) {}
     any(const char* x): type(Dimension::string), string(x) {}
@@ -70,12 +213,22 @@ namespace civita
     template <class T> any& operator=(const T&x) {return *this=any(x);}
     /// true if this is a default constructed object
     bool empty() const {return type==Dimension::string && string.empty();}
+    /// time if type is time, not_a_date_time otherwise
+    boost::posix_time::ptime asTime() const
+    {return type==Dimension::time? time: boost::posix_time::ptime();}
+    /// value if type is value, 0 otherwise
+    double asValue() const {return type==Dimension::value? value: 0;}
   };
 
   inline size_t any::hash() const {
     switch (type) {
-    case Dimension::string: return std::hash<std::string>()(string);
-    case Dimension::time: return std::hash<size_t>()((time-boost::posix_time::ptime()).ticks());
+    case Dimension::string: return string.hash();
+    case Dimension::time:
+      {
+        // measured from a real epoch, as ptime() is not_a_date_time
+        static const boost::posix_time::ptime epoch(boost::gregorian::date(1970,1,1));
+        return std::hash<int64_t>()((time-epoch).ticks());
+      }
     case Dimension::value: return std::hash<double>()(value);
     }
     assert(false);
@@ -86,8 +239,8 @@ namespace civita
     if (x.type==y.type)
       switch (x.type)   {
       case Dimension::string: return x.string<y.string;
-      case Dimension::time: return x.time<y.time;
-      case Dimension::value: return x.value<y.value;
+      case Dimension::time: return x.asTime()<y.asTime();
+      case Dimension::value: return x.asValue()<y.asValue();
       }
     return x.type<y.type;
   }
@@ -96,8 +249,8 @@ namespace civita
     if (x.type==y.type)
       switch (x.type)   {
       case Dimension::string: return x.string<=y.string;
-      case Dimension::time: return x.time<=y.time;
-      case Dimension::value: return x.value<=y.value;
+      case Dimension::time: return x.asTime()<=y.asTime();
+      case Dimension::value: return x.asValue()<=y.asValue();
       }
     return x.type<y.type;
   }
@@ -110,8 +263,8 @@ namespace civita
     switch (x.type)   {
     case Dimension::string: return x.string==y.string;
       // peculiar syntax to work around compiler bug in implementing C++20 ambiguity rules
-    case Dimension::time: return x.time.operator==(y.time); 
-    case Dimension::value: return x.value==y.value;
+    case Dimension::time: return x.asTime().operator==(y.asTime()); 
+    case Dimension::value: return x.asValue()==y.asValue();
     }
     assert(false);
     return false; // should never be here
@@ -129,8 +282,8 @@ namespace civita
     switch (x.type)
       {
       case Dimension::string: return a<=0.5? x: y;
-      case Dimension::value: return y.value*a+x.value*(1-a);
-      case Dimension::time: return x.time + (y.time-x.time)*a;
+      case Dimension::value: return y.asValue()*a+x.asValue()*(1-a);
+      case Dimension::time: return x.asTime() + (y.asTime()-x.asTime())*a;
       }
     assert(false);
     return {}; // unreachable code to satisfy CodeQL
@@ -201,13 +354,13 @@ namespace classdesc_access
       switch (x.type)
         {
         case civita::Dimension::string:
-          b<<x.string;
+          b<<x.string.str();
           break;
         case civita::Dimension::value:
-          b<<x.value;
+          b<<x.asValue();
           break;
         case civita::Dimension::time:
-          b<<x.time;
+          b<<x.asTime();
           break;
         }
     }
@@ -223,13 +376,25 @@ namespace classdesc_access
       switch(x.type)
         {
         case civita::Dimension::string:
-          b>>x.string;
+          {
+            std::string s;
+            b>>s;
+            x.string=s;
+          }
           break;
         case civita::Dimension::value:
-          b>>x.value;
+          {
+            double v;
+            b>>v;
+            x=v;
+          }
           break;
         case civita::Dimension::time:
-          b>>x.time;
+          {
+            boost::posix_time::ptime t;
+            b>>t;
+            x=t;
+          }
           break;
         }
     }
@@ -18,6 +18,9 @@
 */
 
 #include "hypercube.h"
+#include "parallel.h"
+#include <algorithm>
+#include <mutex>
 #include <set>
 
 #ifdef CLASSDESC
@@ -31,53 +34,102 @@ using namespace std;
 
 namespace civita
 {
+  void XVectors::pushIndexAxis(size_t name, unsigned n)
+  {
+    auto axis=makeAxis(std::to_string(name), Dimension(Dimension::value,""));
+    axis->rangeSize=n;
+    axis->range=true;
+    axis->materialised=false;
+    axes.push_back(std::move(axis));
+  }
+
+  void XVectors::Axis::materialise()
+  {
+    lock_guard<mutex> lock(materialiseMutex);
+    if (materialised.load(memory_order_relaxed)) return; // another thread got here first
+    xvector.reserve(rangeSize);
+    for (size_t j=0; j<rangeSize; ++j)
+      xvector.push_back(any(double(j)));
+    materialised.store(true, memory_order_release);
+  }
+
+  size_t XVectors::labelHash(size_t i) const
+  {
+    auto& axis=*axes[i];
+    if (!axis.range || axis.materialised)
+      return axis.labels().labelHash();
+    // range axes are immutable, so their hash is cached
+    if (auto h=axis.rangeHash.load(memory_order_relaxed)) return h;
+    // as per LabelIndex::hash, without materialising the labels
+    size_t h=axis.rangeSize;
+    for (size_t j=0; j<axis.rangeSize; ++j)
+      h=hashCombine(h, any(double(j)).hash());
+    axis.rangeHash.store(h, memory_order_relaxed);
+    return h;
+  }
+
+  size_t XVectors::position(size_t i, const any& label) const
+  {
+    auto& axis=*axes[i];
+    if (!axis.range)
+      return axis.labels().position(label);
+    auto value=label.asValue();
+    if (label.type==Dimension::value && value>=0 &&
+        value<axis.rangeSize && value==size_t(value))
+      return value;
+    return axis.rangeSize;
+  }
+  
+  size_t Hypercube::hash() const
+  {
+    size_t h=rank();
+    for (size_t i=0; i<rank(); ++i)
+      h=hashCombine(h, xvectors.labelHash(i));
+    return h;
+  }
+  
   std::vector<unsigned> Hypercube::dims() const
   {
     std::vector<unsigned> d;
-    for (auto& i: xvectors) d.push_back(i.size());
+    for (size_t i=0; i<rank(); ++i) d.push_back(xvectors.axisSize(i));
     return d;
   }
   
   std::vector<string> Hypercube::dimLabels() const
   {
     std::vector<std::string> l;			  
-    for (auto& i: xvectors) l.push_back(static_cast<std::string>(i.name));
+    for (size_t i=0; i<rank(); ++i) l.push_back(xvectors.namedDimension(i).name);
     return l;
   }      
 
   std::vector<unsigned> const& Hypercube::dims(const std::vector<unsigned>& d) {
     xvectors.clear();
     for (size_t i=0; i<d.size(); ++i)
-      {
-        xvectors.emplace_back(std::to_string(i));
-        xvectors.back().dimension.type=Dimension::value;
-        for (size_t j=0; j<d[i]; ++j)
-          xvectors.back().emplace_back(double(j));
-      }
+      xvectors.pushIndexAxis(i, d[i]);
     return d;
   }
 
   size_t Hypercube::numElements() const
     {
       size_t s=1;
-      for (auto& i: xvectors)
-        s*=i.size();
+      for (size_t i=0; i<rank(); ++i)
+        s*=xvectors.axisSize(i);
       return s;
     }
 
   double Hypercube::logNumElements() const
   {
     double r=0;
-    for (auto& i: xvectors)
-      r+=log(i.size());
+    for (size_t i=0; i<rank(); ++i)
+      r+=log(xvectors.axisSize(i));
     return r;
   }
 
   bool Hypercube::dimsAreDistinct() const
   {
     set<string> names;
-    for (auto& xv: xvectors)
-      if (!names.insert(xv.name).second)
+    for (size_t i=0; i<rank(); ++i)
+      if (!names.insert(xvectors.namedDimension(i).name).second)
         return false;
     return true;
   }
@@ -88,9 +140,9 @@ namespace civita
   {
     std::vector<size_t> splitIndex;
     splitIndex.reserve(xvectors.size());
-    for (auto& xv: xvectors)
+    for (size_t j=0; j<xvectors.size(); ++j)
       {
-        auto res=div(ssize_t(i),ssize_t(xv.size()));
+        auto res=div(ssize_t(i),ssize_t(xvectors.axisSize(j)));
         splitIndex.push_back(res.rem);
         i=res.quot;
       }
@@ -100,6 +152,59 @@ namespace civita
   template 
   size_t Hypercube::linealIndex<vector<size_t>>(const vector<size_t>& splitIndex) const;
 
+  namespace
+  {
+    /// sorted copy of \a labels, with duplicates removed
+    vector<any> sortedLabels(const XVector& labels)
+    {
+      vector<any> r(labels.begin(), labels.end());
+      if (!is_sorted(r.begin(), r.end()))
+        sort(r.begin(), r.end());
+      r.erase(unique(r.begin(), r.end(), [](const any& x, const any& y){return !(x<y);}), r.end());
+      return r;
+    }
+
+    /// merges the labels of \a xvector into the sorted labels \a labels
+    /// @return false if the intersection is empty, and so the resulting hypercube is empty
+    bool mergeLabels(vector<any>& labels, const XVector& xvector, bool intersection)
+    {
+      auto xLabels=sortedLabels(xvector);
+      vector<any> merged;
+      merged.reserve(labels.size()+xLabels.size());
+      if (xvector.dimension.type==Dimension::string)
+        // compute the intersection of the two x-vectors.
+        set_intersection(labels.begin(), labels.end(), xLabels.begin(), xLabels.end(),
+                         back_inserter(merged));
+      else if (intersection)
+        {
+          if (labels.empty()) return false;
+          if (xLabels.empty())
+            labels.clear();
+          else
+            {
+              // trim to intersection of the two
+              auto minX=xLabels.front(), maxX=xLabels.back();
+              if (minX<labels.front()) minX=labels.front();
+              if (labels.back()<maxX) maxX=labels.back();
+              auto first=lower_bound(labels.begin(), labels.end(), minX);
+              auto last=upper_bound(first, labels.end(), maxX);
+              if (last<first) last=first;
+              // diff throws if the label types are incompatible
+              vector<any> xTrimmed;
+              for (auto& i: xLabels)
+                if (diff(minX,i)<=0 && diff(i,maxX)<=0)
+                  xTrimmed.push_back(i);
+              set_union(first, last, xTrimmed.begin(), xTrimmed.end(), back_inserter(merged));
+            }
+        }
+      else
+        set_union(labels.begin(), labels.end(), xLabels.begin(), xLabels.end(),
+                  back_inserter(merged));
+      labels.swap(merged);
+      return true;
+    }
+  }
+  
   void unionHypercube(Hypercube& result, const Hypercube& x, bool intersection)
   {
     if (x.logNumElements()==1)
@@ -107,67 +212,81 @@ namespace civita
         result.xvectors.clear(); // intersection empty anyway
         return;
       }
-    map<string, set<any, AnyLess>> indexedData;
-    vector<XVector> extraDims;
-    for (auto& xvector: result.xvectors)
+    // axes are grouped by name, each group being merged independently
+    struct Group
+    {
+      vector<any> labels;
+      vector<const XVector*> xvectors; // axes of x to be merged, in order
+      bool empty=false; // intersection found to be empty
+    };
+    map<string, Group> groups;
+    for (auto& xvector: as_const(result.xvectors))
       {
-        auto& xvectorData=indexedData[xvector.name];
-        for (auto& i: xvector)
-          xvectorData.insert(i);
+        auto& labels=groups[xvector.name].labels;
+        auto sorted=sortedLabels(xvector);
+        if (labels.empty())
+          labels.swap(sorted);
+        else
+          {
+            vector<any> merged;
+            set_union(labels.begin(), labels.end(), sorted.begin(), sorted.end(),
+                      back_inserter(merged));
+            labels.swap(merged);
+          }
       }
-    for (auto& xvector: x.xvectors)
+    size_t numLabels=0;
+    vector<XVectors::const_iterator> extraDims;
+    for (auto xvector=x.xvectors.begin(); xvector!=x.xvectors.end(); ++xvector)
       {
-        auto xvectorData=indexedData.find(xvector.name);
-        if (xvectorData==indexedData.end())
-          extraDims.emplace_back(xvector);
+        auto group=groups.find(xvector->name);
+        if (group==groups.end())
+          extraDims.push_back(xvector);
         else
           {
-            if (xvector.dimension.type==Dimension::string)
-              {
-                // compute the intersection of the two x-vectors.
-                set<any, AnyLess> xvectorAsSet(xvector.begin(), xvector.end());
-                for (auto i=xvectorData->second.begin(); i!=xvectorData->second.end(); )
-                  if (xvectorAsSet.count(*i))
-                    ++i;
-                  else
-                    i=xvectorData->second.erase(i);
-              }
-            else if (intersection)
-              {
-                if (xvectorData->second.empty())
-                  {
-                    result.xvectors.clear(); // intersection empty anyway
-                    return;
-                  }
-                // trim to intersection of the two
-                // TODO use structured binding when we go C++17.
-                auto xRange=std::minmax_element(xvector.begin(),xvector.end());
-                auto minX=*xRange.first, maxX=*xRange.second;
-                auto rRange=std::minmax_element(xvectorData->second.begin(),xvectorData->second.end());
-                if (minX<*rRange.first) minX=*rRange.first;
-                if (*rRange.second<maxX) maxX=*rRange.second;
-                for (auto i=xvectorData->second.begin(); i!=xvectorData->second.end(); )
-                  {
-                    auto j=i++;
-                    if (*j<minX || maxX<*j)
-                      xvectorData->second.erase(j);
-                  }
-                for (auto& i: xvector)
-                  if (diff(minX,i)<=0 && diff(i,maxX)<=0)
-                    xvectorData->second.insert(i);
-              }
-            else
-              xvectorData->second.insert(xvector.begin(), xvector.end());
+            group->second.xvectors.push_back(&*xvector);
+            numLabels+=group->second.labels.size()+xvector->size();
           }
       }
-    for (auto& xvector: result.xvectors)
+
+    vector<Group*> work;
+    for (auto& i: groups)
+      if (!i.second.xvectors.empty())
+        work.push_back(&i.second);
+    auto mergeGroups=[&](size_t begin, size_t end) {
+      for (auto i=begin; i<end; ++i)
+        for (auto xvector: work[i]->xvectors)
+          if (!mergeLabels(work[i]->labels, *xvector, intersection))
+            {
+              work[i]->empty=true;
+              break;
+            }
+    };
+    if (numLabels<minParallelElements)
+      mergeGroups(0, work.size());
+    else
+      parallelFor(work.size(), mergeGroups);
+    for (auto i: work)
+      if (i->empty)
+        {
+          result.xvectors.clear(); // intersection empty anyway
+          return;
+        }
+    
+    for (size_t i=0; i<result.xvectors.size(); ++i)
       {
-        auto& xvectorData=indexedData[xvector.name];
-        xvector.clear();
-        xvector.insert(xvector.end(), xvectorData.begin(), xvectorData.end());
+        auto& xvector=as_const(result.xvectors)[i];
+        auto& labels=groups[xvector.name].labels;
+        // leave unchanged axes shared
+        if (!equal(xvector.begin(), xvector.end(), labels.begin(), labels.end()))
+          {
+            XVector xv(xvector.name, xvector.dimension);
+            xv.assign(labels.begin(), labels.end());
+            result.xvectors.replace(i, std::move(xv));
+          }
       }
-    for (auto& i: extraDims)
-      result.xvectors.push_back(i);
+    // extra axes share their labels with x
+    for (auto i: extraDims)
+      result.xvectors.insert(result.xvectors.end(), i, i+1);
   }
 
   string Hypercube::json() const
@@ -21,9 +21,211 @@
 #define CIVITA_HYPERCUBE_H
 
 #include "xvector.h"
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
 
 namespace civita
 {
+  /// The axes of a Hypercube. Each axis is shared between copies of
+  /// this container until it is modified (copy on write), so copying
+  /// a hypercube costs O(rank), rather than copying every label.
+  /// Indexing and iteration give read only access to the axes, even
+  /// on a non-const container. An axis is only detached from its
+  /// copies when modifiable access is requested via mutableAxis(), and
+  /// that reference should not be used to modify the axis after this
+  /// container has been copied.
+  ///
+  /// Hypercube::xvectors was formerly a std::vector<XVector>. XVectors
+  /// provides the vector interface used with it (indexing, iterators,
+  /// push_back/emplace_back, insert, erase, resize etc) and converts
+  /// to std::vector<XVector>, but is a distinct type: code passing
+  /// xvectors to a std::vector<XVector>& parameter, relying on
+  /// contiguous XVector storage (eg &xvectors[0]+i), or modifying an
+  /// axis through xvectors[i], needs updating to use mutableAxis(i).
+  class XVectors
+  {
+    /// an axis. A range axis has the value labels 0..rangeSize-1,
+    /// which are only materialised when the labels are accessed.
+    struct Axis
+    {
+      XVector xvector; // labels are empty until materialised for a range axis
+      std::size_t rangeSize=0;
+      bool range=false; // true whilst the labels are 0..rangeSize-1
+      std::atomic<bool> materialised{true};
+      std::mutex materialiseMutex;
+      /// label hash of a range axis, or 0 if not yet computed
+      std::atomic<std::size_t> rangeHash{0};
+      template <class... A> explicit Axis(A&&... a): xvector(std::forward<A>(a)...) {}
+      const XVector& labels() {
+        if (!materialised.load(std::memory_order_acquire)) materialise();
+        return xvector;
+      }
+      void materialise();
+    };
+    using Ptr=std::shared_ptr<Axis>;
+    using Impl=std::vector<Ptr>;
+    Impl axes;
+
+    template <class... A> static Ptr makeAxis(A&&... a)
+    {return std::make_shared<Axis>(std::forward<A>(a)...);}
+    static XVector& deref(Ptr& x) {
+      if (x.use_count()>1)
+        x=makeAxis(x->labels());
+      else
+        {
+          x->labels();
+          x->range=false; // caller may modify the labels
+        }
+      return x->xvector;
+    }
+    static const XVector& deref(const Ptr& x) {return x->labels();}
+
+    template <class I, class R>
+    class Iterator
+    {
+      I i;
+      friend class XVectors;
+      template <class, class> friend class Iterator;
+    public:
+      using iterator_category=std::random_access_iterator_tag;
+      using value_type=XVector;
+      using difference_type=std::ptrdiff_t;
+      using reference=R&;
+      using pointer=R*;
+      Iterator() {}
+      explicit Iterator(I i): i(i) {}
+      /// allows conversion of iterator to const_iterator
+      template <class J, class S, class=std::enable_if_t<std::is_convertible<J,I>::value>>
+      Iterator(const Iterator<J,S>& x): i(x.i) {}
+      reference operator*() const {return deref(*i);}
+      pointer operator->() const {return &deref(*i);}
+      reference operator[](difference_type n) const {return deref(i[n]);}
+      Iterator& operator++() {++i; return *this;}
+      Iterator operator++(int) {return Iterator(i++);}
+      Iterator& operator--() {--i; return *this;}
+      Iterator operator--(int) {return Iterator(i--);}
+      Iterator& operator+=(difference_type n) {i+=n; return *this;}
+      Iterator& operator-=(difference_type n) {i-=n; return *this;}
+      Iterator operator+(difference_type n) const {return Iterator(i+n);}
+      Iterator operator-(difference_type n) const {return Iterator(i-n);}
+      friend Iterator operator+(difference_type n, const Iterator& x) {return x+n;}
+      difference_type operator-(const Iterator& x) const {return i-x.i;}
+      bool operator==(const Iterator& x) const {return i==x.i;}
+      bool operator!=(const Iterator& x) const {return i!=x.i;}
+      bool operator<(const Iterator& x) const {return i<x.i;}
+      bool operator>(const Iterator& x) const {return i>x.i;}
+      bool operator<=(const Iterator& x) const {return i<=x.i;}
+      bool operator>=(const Iterator& x) const {return i>=x.i;}
+    };
+    
+  public:
+    using value_type=XVector;
+    using size_type=std::size_t;
+    using difference_type=std::ptrdiff_t;
+    using reference=XVector&;
+    using const_reference=const XVector&;
+    using iterator=Iterator<Impl::iterator, XVector>;
+    using const_iterator=Iterator<Impl::const_iterator, const XVector>;
+
+    XVectors() {}
+    XVectors(const std::vector<XVector>& x) {insert(end(),x.begin(),x.end());}
+    XVectors(std::vector<XVector>&& x) {
+      axes.reserve(x.size());
+      for (auto& i: x) axes.push_back(makeAxis(std::move(i)));
+    }
+    XVectors(const std::initializer_list<XVector>& x) {insert(end(),x.begin(),x.end());}
+    operator std::vector<XVector>() const {return std::vector<XVector>(begin(),end());}
+
+    std::size_t size() const {return axes.size();}
+    bool empty() const {return axes.empty();}
+    void reserve(std::size_t n) {axes.reserve(n);}
+    
+    const XVector& operator[](std::size_t i) const {return deref(axes[i]);}
+    const XVector& at(std::size_t i) const {return deref(axes.at(i));}
+    const XVector& front() const {return deref(axes.front());}
+    const XVector& back() const {return deref(axes.back());}
+    /// modifiable axis \a i, detached from any copies of this container
+    XVector& mutableAxis(std::size_t i) {return deref(axes.at(i));}
+    
+    const_iterator begin() const {return const_iterator(axes.begin());}
+    const_iterator end() const {return const_iterator(axes.end());}
+    const_iterator cbegin() const {return begin();}
+    const_iterator cend() const {return end();}
+
+    /// append a range axis: a value axis named \a name with labels
+    /// 0..\a n-1, which are only materialised when accessed via
+    /// operator[], iterators etc. Its size, name and dimension, label
+    /// positions and equality with other range axes are available
+    /// without materialising the labels.
+    void pushIndexAxis(std::size_t name, unsigned n);
+    /// true if axis \a i is a range axis, not modified since creation
+    bool isRange(std::size_t i) const {return axes[i]->range;}
+    /// number of labels along axis \a i
+    std::size_t axisSize(std::size_t i) const
+    {return axes[i]->range? axes[i]->rangeSize: axes[i]->xvector.size();}
+    /// name and dimension of axis \a i
+    const NamedDimension& namedDimension(std::size_t i) const {return axes[i]->xvector;}
+    /// position of \a label along axis \a i, or axisSize(i) if not present
+    std::size_t position(std::size_t i, const any& label) const;
+    /// replace axis \a i, without copying its previous labels
+    void replace(std::size_t i, XVector x) {axes[i]=makeAxis(std::move(x));}
+    
+    void push_back(const XVector& x) {axes.push_back(makeAxis(x));}
+    void push_back(XVector&& x) {axes.push_back(makeAxis(std::move(x)));}
+    template <class... A> XVector& emplace_back(A&&... a) {
+      axes.push_back(makeAxis(std::forward<A>(a)...));
+      return axes.back()->xvector;
+    }
+    iterator insert(const_iterator pos, const XVector& x)
+    {return iterator(axes.insert(pos.i, makeAxis(x)));}
+    /// inserts the axes [\a first, \a last) of another XVectors, sharing their labels
+    iterator insert(const_iterator pos, const_iterator first, const_iterator last)
+    {return iterator(axes.insert(pos.i, first.i, last.i));}
+    template <class I>
+    iterator insert(const_iterator pos, I first, I last) {
+      Impl tmp;
+      for (; first!=last; ++first) tmp.push_back(makeAxis(*first));
+      return iterator(axes.insert(pos.i, tmp.begin(), tmp.end()));
+    }
+    iterator erase(const_iterator pos) {return iterator(axes.erase(pos.i));}
+    iterator erase(const_iterator first, const_iterator last)
+    {return iterator(axes.erase(first.i, last.i));}
+    void pop_back() {axes.pop_back();}
+    void clear() {axes.clear();}
+    void resize(std::size_t n) {
+      auto oldSize=axes.size();
+      axes.resize(n);
+      for (auto i=oldSize; i<n; ++i) axes[i]=makeAxis();
+    }
+    void swap(XVectors& x) {axes.swap(x.axes);}
+    
+    /// compares labels of each axis. Shared axes, and axes with
+    /// differing label hashes are compared without examining the
+    /// labels, as are pairs of range axes.
+    bool operator==(const XVectors& x) const {
+      if (size()!=x.size()) return false;
+      for (std::size_t i=0; i<size(); ++i)
+        if (axes[i]!=x.axes[i])
+          {
+            if (isRange(i) && x.isRange(i))
+              {
+                if (axes[i]->rangeSize!=x.axes[i]->rangeSize) return false;
+              }
+            else if (labelHash(i)!=x.labelHash(i) || !(deref(axes[i])==deref(x.axes[i])))
+              return false;
+          }
+      return true;
+    }
+    bool operator!=(const XVectors& x) const {return !operator==(x);}
+    /// hash of the labels of axis \a i. See XVector::labelHash(). A
+    /// range axis's hash is computed once, without materialising its labels.
+    std::size_t labelHash(std::size_t i) const;
+    /// true if axis \a i of this shares its labels with axis \a j of \a x
+    bool shared(std::size_t i, const XVectors& x, std::size_t j) const
+    {return axes[i]==x.axes[j];}
+  };
   
   struct Hypercube
   {
@@ -34,11 +236,15 @@ namespace civita
     Hypercube(const std::vector<XVector>& d): xvectors(d) {}
     Hypercube(std::vector<XVector>&& d): xvectors(std::move(d)) {}
     
-    std::vector<XVector> xvectors;
+    XVectors xvectors;
     std::size_t rank() const {return xvectors.size();}
 
     bool operator==(const Hypercube& x) const {return xvectors==x.xvectors;}
     bool operator!=(const Hypercube& x) const {return !operator==(x);}
+    /// hash of the labels of each axis, suitable for keying caches of
+    /// hypercubes. Like operator==, axis names and dimensions are not
+    /// included, so equal hypercubes have equal hashes.
+    std::size_t hash() const;
     
     /// dimensions of this variable value. dims.size() is the rank, a
     ///scalar variable has dims[0]=1, etc.
@@ -72,10 +278,10 @@ namespace civita
       auto ii=splitIndex.begin();
       for (std::size_t i=0; i<xvectors.size(); ++i, ++ii)
         {
-          if (size_t(*ii)<xvectors[i].size())
+          if (size_t(*ii)<xvectors.axisSize(i))
             {
               index+=*ii * stride;
-              stride*=xvectors[i].size();
+              stride*=xvectors.axisSize(i);
             }
           else
             return std::numeric_limits<size_t>::max(); // invalid linealIndex
@@ -96,4 +302,68 @@ namespace civita
   void unionHypercube(Hypercube& result, const Hypercube& x, bool intersection=true);
 }
 
+namespace std
+{
+  template <> struct hash<civita::Hypercube>
+  {
+    size_t operator()(const civita::Hypercube& x) const {return x.hash();}
+  };
+}
+
+#ifdef CLASSDESC
+#pragma omit pack civita::XVectors
+#pragma omit unpack civita::XVectors
+#pragma omit json_pack civita::XVectors
+#pragma omit json_unpack civita::XVectors
+#pragma omit RESTProcess civita::XVectors
+#include <json_pack_base.h>
+#include <pack_base.h>
+// XVectors are serialised as a vector of XVector
+namespace classdesc_access
+{
+  template <>
+  struct access_json_pack<civita::XVectors>
+  {
+    template <class T>
+    void operator()(classdesc::json_pack_t& j, const std::string& d, T& x)
+    {
+      std::vector<civita::XVector> v(x);
+      classdesc::json_pack(j,d,v);
+    }
+  };
+  template <>
+  struct access_json_unpack<civita::XVectors>
+  {
+    template <class T>
+    void operator()(classdesc::json_unpack_t& j, const std::string& d, T& x)
+    {
+      std::vector<civita::XVector> v;
+      classdesc::json_unpack(j,d,v);
+      x=std::move(v);
+    }
+  };
+  template <>
+  struct access_pack<civita::XVectors>
+  {
+    template <class T>
+    void operator()(classdesc::pack_t& b, const std::string& d, T& x)
+    {
+      std::vector<civita::XVector> v(x);
+      classdesc::pack(b,d,v);
+    }
+  };
+  template <>
+  struct access_unpack<civita::XVectors>
+  {
+    template <class T>
+    void operator()(classdesc::pack_t& b, const std::string& d, T& x)
+    {
+      std::vector<civita::XVector> v;
+      classdesc::unpack(b,d,v);
+      x=std::move(v);
+    }
+  };
+}
+#endif
+
 #endif
@@ -19,18 +19,29 @@
 
 
 #include "index.h"
+#include "parallel.h"
 #include <algorithm>
+#include <array>
 #include <atomic>
+#include <cstddef>
+#include <new>
+#include <typeindex>
 #include <assert.h>
 // Windows byte definition clashes with std::byte, even though we don't use it.
 using std::atomic;
 using std::bad_alloc;
 using std::size_t;
 
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #endif
 
@@ -49,17 +60,22 @@ namespace civita
 {
   size_t Index::linealOffset(size_t h) const
   {
-    if (linealOffsetLookup.empty())
+    if (!data) return 0;
+    auto& lookup=data->linealOffsetLookup;
+    if (!data->linealOffsetLookupBuilt)
       {
-        lock_guard<mutex> lock(linealOffsetMutex);
-        if (linealOffsetLookup.empty()) // in case another thread got here first
-          for (auto i: index)
-            linealOffsetLookup.emplace(i,linealOffsetLookup.size());
+        lock_guard<mutex> lock(data->linealOffsetMutex);
+        if (!data->linealOffsetLookupBuilt) // in case another thread got here first
+          {
+            for (auto i: data->index)
+              lookup.emplace(i,lookup.size());
+            data->linealOffsetLookupBuilt=true;
+          }
       }
 
-    auto it=linealOffsetLookup.find(h);
-    if (it!=linealOffsetLookup.end()) return it->second;
-    return index.size();
+    auto it=lookup.find(h);
+    if (it!=lookup.end()) return it->second;
+    return data->index.size();
   }
   
   size_t physicalMem() 
@@ -85,21 +101,473 @@ namespace civita
 #endif  
   }
   
+  namespace
+  {
+    /// owner of an allocation made by trackedAlloc, stored in front of
+    /// it, or alongside a spilled region
+    struct alignas(max_align_t) AllocationHeader
+    {
+      MemoryAttribution::Stats* category=nullptr;
+      MemoryAttribution::Stats* tensor=nullptr;
+      /// owner records of the current attribution scope, retained
+      static AllocationHeader current();
+      void release();
+    };
+
+    struct MemoryAccount
+    {
+      atomic<size_t> allocated{0}, peak{0};
+      // discount factor determined empirically to prevent application being pushed into swap
+      atomic<size_t> budget{size_t(0.6*physicalMem())};
+
+      mutex thresholdMutex;
+      vector<size_t> thresholds; // sorted
+      MemoryThresholdCallback thresholdCallback;
+      size_t thresholdLevel=0; // number of thresholds below allocated
+      // allocated values outside [thresholdDown,thresholdUp) require a threshold check
+      atomic<size_t> thresholdDown{0}, thresholdUp{~size_t(0)};
+      void setThresholdBounds() {
+        thresholdDown=thresholdLevel>0? thresholds[thresholdLevel-1]: 0;
+        thresholdUp=thresholdLevel<thresholds.size()? thresholds[thresholdLevel]: ~size_t(0);
+      }
+      void checkThresholds(size_t current);
+
+      // guards the registries below, which are only consulted when
+      // attribution scopes are created - the statistics themselves are atomic
+      mutex statsMutex;
+      map<string,MemoryAttribution::Stats*> byCategory;
+      map<type_index,MemoryAttribution::Stats*> byType; // shares records with byCategory
+      map<const void*,MemoryAttribution::Stats*> byTensor;
+      MemoryAttribution::Stats* categoryStats(const string&);
+      MemoryAttribution::Stats* categoryStats(const type_info&);
+      MemoryAttribution::Stats* tensorStats(const void*);
+
+      atomic<bool> spill{false};
+      atomic<size_t> spilled{0};
+      mutex spillMutex;
+      string spillDirectory;
+      struct SpilledRegion
+      {
+        size_t size;
+        AllocationHeader owner;
+      };
+      map<void*,SpilledRegion> spilledRegions;
+
+      bool withinBudget(ptrdiff_t n) const {return n<=0 || allocated+n<=budget;}
+      void record(ptrdiff_t n, MemoryAttribution::Stats* category, MemoryAttribution::Stats* tensor);
+      void* spillAlloc(size_t n, const AllocationHeader& owner);
+      bool spillFree(void* p);
+    };
+
+    // deliberately leaked, as deallocations may be tracked during static destruction
+    MemoryAccount& account() {static auto a=new MemoryAccount; return *a;}
+    
+    thread_local const MemoryAttribution* currentAttribution=nullptr;
+
+    void MemoryAccount::checkThresholds(size_t current)
+    {
+      vector<pair<size_t,bool>> crossed;
+      MemoryThresholdCallback callback;
+      {
+        lock_guard<mutex> lock(thresholdMutex);
+        for (; thresholdLevel<thresholds.size() && current>=thresholds[thresholdLevel]; ++thresholdLevel)
+          crossed.emplace_back(thresholds[thresholdLevel],true);
+        for (; thresholdLevel>0 && current<thresholds[thresholdLevel-1]; --thresholdLevel)
+          crossed.emplace_back(thresholds[thresholdLevel-1],false);
+        setThresholdBounds();
+        callback=thresholdCallback;
+      }
+      // called outside the lock, in case the callback allocates
+      if (callback)
+        for (auto& i: crossed)
+          callback(i.first,current,i.second);
+    }
+    
+  }
+
+  /// reference counted, as records are shared by the registry,
+  /// attribution scopes and outstanding allocations
+  struct MemoryAttribution::Stats
+  {
+    const string name;
+    atomic<size_t> allocations{0}, bytesAllocated{0}, bytesFreed{0}, peak{0};
+    atomic<ptrdiff_t> outstanding{0};
+    atomic<size_t> refs{1};
+    Stats(const string& name): name(name) {}
+    static Stats* retain(Stats* s) {if (s) ++s->refs; return s;}
+    static void release(Stats* s) {if (s && --s->refs==0) delete s;}
+    void update(ptrdiff_t n) {
+      if (n>0)
+        {
+          ++allocations;
+          bytesAllocated+=n;
+        }
+      else
+        bytesFreed-=n;
+      auto current=outstanding+=n;
+      auto p=peak.load();
+      while (current>ptrdiff_t(p) && !peak.compare_exchange_weak(p,current));
+    }
+    AllocationStats stats() const {return {allocations, bytesAllocated, bytesFreed, peak};}
+  };
+
+  namespace
+  {
+    /// releases the records of a registry, and clears it
+    template <class K> void clearRegistry(map<K,MemoryAttribution::Stats*>& registry)
+    {
+      for (auto& i: registry) MemoryAttribution::Stats::release(i.second);
+      registry.clear();
+    }
+
+    // The following return records retained on behalf of the caller
+    MemoryAttribution::Stats* MemoryAccount::categoryStats(const string& category)
+    {
+      lock_guard<mutex> lock(statsMutex);
+      auto& stats=byCategory[category];
+      if (!stats) stats=new MemoryAttribution::Stats(category);
+      return MemoryAttribution::Stats::retain(stats);
+    }
+
+    MemoryAttribution::Stats* MemoryAccount::categoryStats(const type_info& type)
+    {
+      {
+        lock_guard<mutex> lock(statsMutex);
+        auto i=byType.find(type);
+        if (i!=byType.end()) return MemoryAttribution::Stats::retain(i->second);
+      }
+      string category=type.name();
+#ifdef __GNUC__
+      int status;
+      if (auto name=abi::__cxa_demangle(type.name(), nullptr, nullptr, &status))
+        {
+          if (status==0) category=name;
+          free(name);
+        }
+#endif
+      auto stats=categoryStats(category);
+      lock_guard<mutex> lock(statsMutex);
+      auto& cached=byType[type];
+      if (!cached) cached=MemoryAttribution::Stats::retain(stats);
+      return stats;
+    }
+
+    MemoryAttribution::Stats* MemoryAccount::tensorStats(const void* tensor)
+    {
+      if (!tensor) return nullptr;
+      lock_guard<mutex> lock(statsMutex);
+      auto& stats=byTensor[tensor];
+      if (!stats) stats=new MemoryAttribution::Stats({});
+      return MemoryAttribution::Stats::retain(stats);
+    }
+  }
+
+  namespace
+  {
+    AllocationHeader AllocationHeader::current()
+    {
+      AllocationHeader owner;
+      if (auto attribution=currentAttribution)
+        {
+          owner.category=MemoryAttribution::Stats::retain(attribution->categoryStats());
+          owner.tensor=MemoryAttribution::Stats::retain(attribution->tensorStats());
+        }
+      return owner;
+    }
+
+    void AllocationHeader::release()
+    {
+      MemoryAttribution::Stats::release(category);
+      MemoryAttribution::Stats::release(tensor);
+    }
+  }
+
+  MemoryAttribution::MemoryAttribution(const string& category, const void* tensor):
+    m_categoryStats(account().categoryStats(category)),
+    m_tensorStats(account().tensorStats(tensor)), m_tensor(tensor), m_prev(currentAttribution)
+  {currentAttribution=this;}
+  
+  MemoryAttribution::MemoryAttribution(const std::type_info& type, const void* tensor):
+    m_categoryStats(account().categoryStats(type)),
+    m_tensorStats(account().tensorStats(tensor)), m_tensor(tensor), m_prev(currentAttribution)
+  {currentAttribution=this;}
+
+  MemoryAttribution::MemoryAttribution(const MemoryAttribution& x):
+    m_categoryStats(Stats::retain(x.m_categoryStats)),
+    m_tensorStats(Stats::retain(x.m_tensorStats)), m_tensor(x.m_tensor), m_prev(currentAttribution)
+  {currentAttribution=this;}
+  
+  MemoryAttribution::~MemoryAttribution()
+  {
+    currentAttribution=m_prev;
+    Stats::release(m_categoryStats);
+    Stats::release(m_tensorStats);
+  }
+
+  const string& MemoryAttribution::category() const {return m_categoryStats->name;}
+  
+  const MemoryAttribution* MemoryAttribution::current() {return currentAttribution;}
+  
+  void MemoryAccount::record(ptrdiff_t n, MemoryAttribution::Stats* category,
+                             MemoryAttribution::Stats* tensor)
+  {
+    size_t current;
+    if (-n<ptrdiff_t(allocated.load())) // reset allocated to 0 if n would reduce it to a -ve number
+      current=allocated+=n;
+    else
+      current=allocated=0;
+
+    auto p=peak.load();
+    while (current>p && !peak.compare_exchange_weak(p,current));
+
+    if (current>=thresholdUp || current<thresholdDown)
+      checkThresholds(current);
+
+    if (category) category->update(n);
+    if (tensor) tensor->update(n);
+  }
+
+  void* MemoryAccount::spillAlloc(size_t n, const AllocationHeader& owner)
+  {
+    string dir;
+    {
+      lock_guard<mutex> lock(spillMutex);
+      dir=spillDirectory;
+    }
+    void* p=nullptr;
+#ifdef _WIN32
+    char tmpDir[MAX_PATH+1], path[MAX_PATH+1];
+    if (dir.empty() && GetTempPathA(sizeof(tmpDir),tmpDir)) dir=tmpDir;
+    if (!GetTempFileNameA(dir.c_str(),"cvt",0,path)) return nullptr;
+    auto file=CreateFileA(path,GENERIC_READ|GENERIC_WRITE,0,nullptr,CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,nullptr);
+    if (file==INVALID_HANDLE_VALUE) return nullptr;
+    // the view keeps the mapping, and hence the file, alive until unmapped
+    if (auto mapping=CreateFileMappingA(file,nullptr,PAGE_READWRITE,DWORD(uint64_t(n)>>32),
+                                        DWORD(n&0xffffffff),nullptr))
+      {
+        p=MapViewOfFile(mapping,FILE_MAP_ALL_ACCESS,0,0,n);
+        CloseHandle(mapping);
+      }
+    CloseHandle(file);
+#else
+    if (dir.empty())
+      {
+        auto tmpDir=getenv("TMPDIR");
+        dir=tmpDir? tmpDir: "/tmp";
+      }
+    string path=dir+"/civitaXXXXXX";
+    int fd=mkstemp(&path[0]);
+    if (fd<0) return nullptr;
+    unlink(path.c_str()); // file is removed once unmapped
+    if (ftruncate(fd,n)==0)
+      {
+        p=mmap(nullptr,n,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+        if (p==MAP_FAILED) p=nullptr;
+      }
+    close(fd);
+#endif
+    if (p)
+      {
+        lock_guard<mutex> lock(spillMutex);
+        spilledRegions.emplace(p,SpilledRegion{n,owner});
+        spilled+=n;
+      }
+    return p;
+  }
+
+  bool MemoryAccount::spillFree(void* p)
+  {
+    SpilledRegion region;
+    {
+      lock_guard<mutex> lock(spillMutex);
+      auto i=spilledRegions.find(p);
+      if (i==spilledRegions.end()) return false;
+      region=i->second;
+      spilledRegions.erase(i);
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(p);
+#else
+    munmap(p,region.size);
+#endif
+    spilled-=region.size;
+    record(-ptrdiff_t(region.size), region.owner.category, region.owner.tensor);
+    region.owner.release();
+    return true;
+  }
+  
   void trackAllocation(ptrdiff_t n)
   {
-    static atomic<size_t> allocated{0}, max_allocated{0};
-    // discount factor determined empirically to prevent application being pushed into swap
-    static size_t memAvailable=0.6*physicalMem();
-    // debug code left for posterity
-    // auto m=max_allocated.load();
-    // while (allocated>m)
-    //   if (max_allocated.compare_exchange_weak(m,allocated))
-    //     cout<<max_allocated<<endl;
-    if (n>0 && allocated+n>memAvailable) // limit allocations to physical memory
+    auto& a=account();
+    if (!a.withinBudget(n)) // limit allocations to the memory budget
       throw bad_alloc();
-    if (-n<ptrdiff_t(allocated)) // reset allocated to 0 if n would reduce it to a -ve number
-      allocated+=n;
-    else
-      allocated=0;
+    auto attribution=currentAttribution;
+    a.record(n, attribution? attribution->categoryStats(): nullptr,
+             attribution? attribution->tensorStats(): nullptr);
+  }
+
+  void* trackedAlloc(size_t n)
+  {
+    auto& a=account();
+    bool spill=a.spill && !a.withinBudget(n);
+    if (!spill && !a.withinBudget(n)) // limit allocations to the memory budget
+      throw bad_alloc();
+    // record the owner, so that the allocation is credited back to it when freed
+    auto owner=AllocationHeader::current();
+    if (spill && n>=minSpillSize)
+      if (auto p=a.spillAlloc(n,owner))
+        {
+          a.record(n, owner.category, owner.tensor);
+          return p;
+        }
+    // otherwise allowed to exceed the budget if spilling is enabled
+    auto p=static_cast<char*>(malloc(sizeof(AllocationHeader)+n));
+    if (!p)
+      {
+        owner.release();
+        throw bad_alloc();
+      }
+    new(p) AllocationHeader(owner);
+    a.record(n, owner.category, owner.tensor);
+    return p+sizeof(AllocationHeader);
+  }
+
+  void trackedFree(void* p, size_t n)
+  {
+    auto& a=account();
+    // spilled regions only need to be searched if there are any
+    if (a.spilled && a.spillFree(p)) return;
+    auto base=static_cast<char*>(p)-sizeof(AllocationHeader);
+    auto owner=*reinterpret_cast<AllocationHeader*>(base);
+    free(base);
+    a.record(-ptrdiff_t(n), owner.category, owner.tensor);
+    owner.release();
+  }
+
+  void radixSort(vector<pair<size_t,size_t>>& v)
+  {
+    auto n=v.size();
+    if (n<minParallelElements)
+      {
+        sort(v.begin(), v.end());
+        return;
+      }
+    size_t maxKey=0;
+    for (auto& i: v) maxKey=max(maxKey, i.first);
+
+    static const unsigned bits=8, radix=1<<bits;
+    auto nBlocks=min(numThreads(), n/minParallelElements);
+    auto blockBegin=[&](size_t b) {return b*n/nBlocks;};
+    vector<array<size_t,radix>> counts(nBlocks);
+    vector<pair<size_t,size_t>> tmp(n);
+    // only digits present in the largest key need sorting
+    for (unsigned shift=0; shift<64 && maxKey>>shift; shift+=bits)
+      {
+        auto digit=[&](size_t key) {return (key>>shift)&(radix-1);};
+        parallelFor(nBlocks, [&](size_t begin, size_t end) {
+          for (auto b=begin; b<end; ++b)
+            {
+              auto& c=counts[b];
+              c.fill(0);
+              for (auto i=blockBegin(b); i<blockBegin(b+1); ++i)
+                ++c[digit(v[i].first)];
+            }
+        });
+        // convert counts into output offsets, ordered by digit, then
+        // by block, which keeps the sort stable
+        size_t offset=0;
+        for (unsigned d=0; d<radix; ++d)
+          for (auto& c: counts)
+            {
+              auto count=c[d];
+              c[d]=offset;
+              offset+=count;
+            }
+        parallelFor(nBlocks, [&](size_t begin, size_t end) {
+          for (auto b=begin; b<end; ++b)
+            {
+              auto& c=counts[b];
+              for (auto i=blockBegin(b); i<blockBegin(b+1); ++i)
+                tmp[c[digit(v[i].first)]++]=v[i];
+            }
+        });
+        v.swap(tmp);
+      }
+  }
+
+  size_t allocatedMemory() {return account().allocated;}
+  size_t peakMemory() {return account().peak;}
+  void resetPeakMemory() {account().peak=account().allocated.load();}
+  size_t memoryBudget() {return account().budget;}
+  void memoryBudget(size_t budget) {account().budget=budget;}
+
+  void memoryThresholds(const vector<size_t>& thresholds, const MemoryThresholdCallback& callback)
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.thresholdMutex);
+    a.thresholds=thresholds;
+    sort(a.thresholds.begin(), a.thresholds.end());
+    a.thresholdCallback=callback;
+    a.thresholdLevel=upper_bound(a.thresholds.begin(), a.thresholds.end(), a.allocated.load())-
+      a.thresholds.begin();
+    a.setThresholdBounds();
+  }
+
+  bool spillToDisk() {return account().spill;}
+  void spillToDisk(bool spill) {account().spill=spill;}
+  size_t spilledMemory() {return account().spilled;}
+
+  string spillDirectory()
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.spillMutex);
+    return a.spillDirectory;
+  }
+  
+  void spillDirectory(const string& dir)
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.spillMutex);
+    a.spillDirectory=dir;
+  }
+  
+  map<string,AllocationStats> allocationStatsByCategory()
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.statsMutex);
+    map<string,AllocationStats> r;
+    for (auto& i: a.byCategory) r.emplace(i.first, i.second->stats());
+    return r;
+  }
+  
+  map<const void*,AllocationStats> allocationStatsByTensor()
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.statsMutex);
+    map<const void*,AllocationStats> r;
+    for (auto& i: a.byTensor) r.emplace(i.first, i.second->stats());
+    return r;
+  }
+
+  void releaseAllocationStats(const void* tensor)
+  {
+    auto& a=account();
+    lock_guard<mutex> lock(a.statsMutex);
+    auto i=a.byTensor.find(tensor);
+    if (i==a.byTensor.end()) return;
+    MemoryAttribution::Stats::release(i->second);
+    a.byTensor.erase(i);
+  }
+  
+  void clearAllocationStats()
+  {
+    // records still referenced by scopes or allocations are retained
+    // by them, but are no longer reported
+    auto& a=account();
+    lock_guard<mutex> lock(a.statsMutex);
+    clearRegistry(a.byCategory);
+    clearRegistry(a.byType);
+    clearRegistry(a.byTensor);
   }
 }
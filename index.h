@@ -23,6 +23,11 @@
 #include <set>
 #include <map>
 #include <mutex>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <typeinfo>
 #include <cstdint>
 #include <cstdlib>
 #include <assert.h>
@@ -35,42 +40,135 @@
 // allocator, such as needed when running this under an electron
 // project. See https://sourceforge.net/p/minsky/ravel/564/
 #ifndef CIVITA_ALLOCATOR
-#define CIVITA_ALLOCATOR std::allocator
+#define CIVITA_ALLOCATOR civita::LibCAllocator
 #endif
 
 namespace civita
 {
+  /// records an allocation (n>0) or deallocation (n<0) of n bytes
+  /// @throw std::bad_alloc if the allocation would exceed memoryBudget()
   void trackAllocation(std::ptrdiff_t n);
+
+  /// total physical memory of the machine
+  std::size_t physicalMem();
+  
+  /// bytes currently allocated via LibCAllocator
+  std::size_t allocatedMemory();
+  /// high water mark of allocatedMemory() since startup, or since resetPeakMemory() was last called
+  std::size_t peakMemory();
+  void resetPeakMemory();
+  /// limit on allocatedMemory(), beyond which allocations throw
+  /// std::bad_alloc. Defaults to 60% of physical memory
+  std::size_t memoryBudget();
+  void memoryBudget(std::size_t);
+
+  /// called whenever allocatedMemory() crosses \a threshold: \a
+  /// exceeded is true when rising above it, false when dropping back
+  /// below. Called from the allocating thread.
+  using MemoryThresholdCallback=
+    std::function<void(std::size_t threshold, std::size_t allocated, bool exceeded)>;
+  /// register thresholds to be monitored. Replaces any previously registered thresholds.
+  void memoryThresholds(const std::vector<std::size_t>& thresholds, const MemoryThresholdCallback&);
+
+  /// statistics of allocations attributed to a category or tensor
+  struct AllocationStats
+  {
+    std::size_t allocations=0;    ///< number of allocations
+    std::size_t bytesAllocated=0; ///< cumulative bytes allocated
+    std::size_t bytesFreed=0;     ///< cumulative bytes freed
+    std::size_t peak=0;           ///< largest number of bytes outstanding at any one time
+  };
+
+  /// Attributes allocations made by this thread, whilst in scope, to
+  /// \a category (eg an operation type) and optionally \a tensor.
+  /// Scopes may be nested, with the innermost scope taking precedence.
+  /// Memory allocated via trackedAlloc is credited back to the scope
+  /// it was allocated in when freed, whichever scope is then current.
+  /// Statistics are looked up when the scope is constructed, so
+  /// allocations within it only update atomic counters.
+  class MemoryAttribution
+  {
+  public:
+    struct Stats; ///< internal: counters of a category or tensor
+  private:
+    Stats* m_categoryStats;
+    Stats* m_tensorStats; // null if no tensor
+    const void* m_tensor;
+    const MemoryAttribution* m_prev;
+  public:
+    MemoryAttribution(const std::string& category, const void* tensor=nullptr);
+    /// category is the demangled name of \a type, computed once per type
+    MemoryAttribution(const std::type_info& type, const void* tensor=nullptr);
+    /// establishes \a x's attribution in the current thread, eg in a
+    /// worker thread. parallelFor does this for its workers.
+    MemoryAttribution(const MemoryAttribution& x);
+    ~MemoryAttribution();
+    /// innermost scope of the current thread, or nullptr if none
+    static const MemoryAttribution* current();
+    MemoryAttribution& operator=(const MemoryAttribution&)=delete;
+    const std::string& category() const;
+    const void* tensor() const {return m_tensor;}
+    Stats* categoryStats() const {return m_categoryStats;}
+    Stats* tensorStats() const {return m_tensorStats;}
+  };
+
+  std::map<std::string,AllocationStats> allocationStatsByCategory();
+  std::map<const void*,AllocationStats> allocationStatsByTensor();
+  /// forget the statistics of \a tensor. Should be called when a
+  /// tensor used for attribution is destroyed, so that the statistics
+  /// are not inherited by a later tensor at the same address.
+  void releaseAllocationStats(const void* tensor);
+  void clearAllocationStats();
     
+  /// allocations smaller than this are not worth spilling to disk
+  constexpr std::size_t minSpillSize=1<<16;
+
+  /// allocate \a n bytes, accounted against memoryBudget(). If the
+  /// budget would be exceeded and spillToDisk() is enabled,
+  /// allocations of at least minSpillSize bytes are mapped onto a
+  /// temporary file instead. Smaller allocations, or ones that cannot
+  /// be spilled, are then allowed to exceed the budget. Spilled bytes
+  /// count towards allocatedMemory(), thresholds and attribution.
+  /// @throw std::bad_alloc if memory cannot be allocated
+  void* trackedAlloc(std::size_t n);
+  /// release memory obtained from trackedAlloc
+  void trackedFree(void* p, std::size_t n);
+
+  /// when enabled, allocations that would exceed memoryBudget() are
+  /// backed by temporary files, rather than throwing
+  /// std::bad_alloc. Allocations smaller than minSpillSize are
+  /// allowed to exceed the budget instead. Disabled by default.
+  bool spillToDisk();
+  void spillToDisk(bool);
+  /// directory where spill files are created. If empty (default), the
+  /// system's temporary directory is used.
+  std::string spillDirectory();
+  void spillDirectory(const std::string&);
+  /// bytes currently spilled to disk
+  std::size_t spilledMemory();
+  
+  /// sorts (index, position) pairs by index, using a parallel LSD
+  /// radix sort for large vectors. Pairs with equal indices retain
+  /// their relative order.
+  void radixSort(std::vector<std::pair<std::size_t,std::size_t>>&);
+  
   template <class T>
   struct LibCAllocator
   {
     using value_type=T;
-    T* allocate(size_t n) {
-      trackAllocation(sizeof(T)*n);
-      if (auto r=reinterpret_cast<T*>(std::malloc(sizeof(T)*n))) return r;
-      throw std::bad_alloc();
-    }
-    void deallocate(T* p, size_t n) {trackAllocation(-sizeof(T)*n); std::free(p);}
-    bool operator==(const LibCAllocator&) const {return true;} // no state!
-    bool operator!=(const LibCAllocator& x) const {return !operator==(x);}
+    LibCAllocator() {}
+    template <class U> LibCAllocator(const LibCAllocator<U>&) {}
+    T* allocate(size_t n) {return reinterpret_cast<T*>(trackedAlloc(sizeof(T)*n));}
+    void deallocate(T* p, size_t n) {trackedFree(p,sizeof(T)*n);}
+    template <class U>
+    bool operator==(const LibCAllocator<U>&) const {return true;} // no state!
+    template <class U>
+    bool operator!=(const LibCAllocator<U>& x) const {return !operator==(x);}
   };
 
-  struct LinealOffsetMutex
-  {
-    mutable std::mutex linealOffsetMutex;
-    LinealOffsetMutex()=default;
-    // done this way to define null copy operations for the mutex
-    LinealOffsetMutex(const LinealOffsetMutex&) {}
-    LinealOffsetMutex& operator=(const LinealOffsetMutex&) {return *this;}
-#if defined(__cplusplus) && __cplusplus >= 202002L && !defined(__APPLE__)
-    std::strong_ordering operator<=>(const LinealOffsetMutex&) const {return std::strong_ordering::equal;}
-#endif
-    bool operator==(const LinealOffsetMutex&) const {return true;}
-  };
-  
-  /// represents index concept for sparse tensors
-  class Index: private LinealOffsetMutex
+  /// represents index concept for sparse tensors. The index vector
+  /// is immutable, and shared between copies of an Index.
+  class Index
     {
     public:
       CLASSDESC_ACCESS(Index);
@@ -86,68 +184,155 @@ namespace civita
       // can only assign ordered containers
       template <class T, class C, class A>
       Index& operator=(const std::set<T,C,A>& indices) {
-        index.clear(); index.reserve(indices.size());
-        linealOffsetLookup.clear();
-        for (auto& i: indices) index.push_back(i);
+        Impl tmp; tmp.reserve(indices.size());
+        for (auto& i: indices) tmp.push_back(i);
+        setIndex(std::move(tmp));
         return *this;
       }
       template <class K, class V, class C, class A>
       Index& operator=(const std::map<K,V,C,A>& indices) {
-        index.clear(); index.reserve(indices.size());
-        linealOffsetLookup.clear();
-        for (auto& i: indices) index.push_back(i.first);
+        Impl tmp; tmp.reserve(indices.size());
+        for (auto& i: indices) tmp.push_back(i.first);
+        setIndex(std::move(tmp));
         return *this;
       }
 
+      bool operator==(const Index& x) const {return data==x.data || index()==x.index();}
+      bool operator!=(const Index& x) const {return !operator==(x);}
 #if defined(__cplusplus) && __cplusplus >= 202002L && !defined(__APPLE__)
-      std::strong_ordering operator<=>(const Index&) const=default;
+      std::strong_ordering operator<=>(const Index& x) const {
+        if (data==x.data) return std::strong_ordering::equal;
+        return index()<=>x.index();
+      }
 #endif
       
       /// return hypercube index corresponding to lineal index i 
-      std::size_t operator[](std::size_t i) const {return index.empty()? i: index[i];}
+      std::size_t operator[](std::size_t i) const {return data? data->index[i]: i;}
       // invariant, should always be true
       bool noDuplicates() const {
         std::set<std::size_t,std::less<std::size_t>,CIVITA_ALLOCATOR<std::size_t>>
-          tmp(index.begin(), index.end());
-        return tmp.size()==index.size();
+          tmp(begin(), end());
+        return tmp.size()==size();
       }
-      bool empty() const {return index.empty();}
-      std::size_t size() const {return index.size();}
-      void clear() {index.clear();linealOffsetLookup.clear();}
+      bool empty() const {return !data;}
+      std::size_t size() const {return data? data->index.size(): 0;}
+      void clear() {data.reset();}
       /// return the lineal index of hypercube index h, or size if not present 
       std::size_t linealOffset(std::size_t h) const;
-      Index::Impl::const_iterator begin() const {return index.begin();}
-      Index::Impl::const_iterator end() const {return index.end();}
+      Index::Impl::const_iterator begin() const {return index().begin();}
+      Index::Impl::const_iterator end() const {return index().end();}
+      /// true if this shares its index vector with \a x
+      bool shared(const Index& x) const {return data && data==x.data;}
     protected:
-      Impl index; // sorted index vector
-      mutable std::map<size_t,size_t> linealOffsetLookup; // cached map of index to linealOffset value
+      struct Data
+      {
+        Data(Impl&& index): index(std::move(index)) {}
+        const Impl index; // sorted index vector
+        mutable std::map<size_t,size_t> linealOffsetLookup; // cached map of index to linealOffset value
+        mutable std::atomic<bool> linealOffsetLookupBuilt{false};
+        mutable std::mutex linealOffsetMutex;
+      };
+      std::shared_ptr<const Data> data; // null if empty
+      const Impl& index() const {
+        static const Impl empty;
+        return data? data->index: empty;
+      }
+      void setIndex(Impl&& indices) {
+        if (indices.empty())
+          data.reset();
+        else
+          data=std::make_shared<const Data>(std::move(indices));
+      }
       // For optimisation to avoid map<=>vector transformation
       friend class PermuteAxis;
+      friend class Dice;
+      friend class Meld;
+      friend class Merge;
+      friend class InterpolateHC;
       friend class Pivot;
       friend class ReductionOp;
       friend class Slice;
+      friend class SpreadFirst;
+      friend class SpreadLast;
       // optimised transfer routines - private because can't guarantee index uniqueness
       void assignVector(Impl&& indices) {
-        index=std::move(indices);
-        linealOffsetLookup.clear();
+        setIndex(std::move(indices));
         assert(noDuplicates());
       }
       template <class T, class A>
       void assignVector(const std::vector<T,A>& indices) {
-        index.clear(); index.reserve(indices.size());
-        linealOffsetLookup.clear();
-        for (auto& i: indices) index.push_back(i);
-         assert(noDuplicates());
+        Impl tmp; tmp.reserve(indices.size());
+        for (auto& i: indices) tmp.push_back(i);
+        setIndex(std::move(tmp));
+        assert(noDuplicates());
       }
       template <class F, class S, class A>
       void assignVector(const std::vector<std::pair<F,S>,A>& indices) {
-        index.clear(); index.reserve(indices.size());
-        linealOffsetLookup.clear();
-        for (auto& i: indices) index.push_back(i.first);
-         assert(noDuplicates());
+        Impl tmp; tmp.reserve(indices.size());
+        for (auto& i: indices) tmp.push_back(i.first);
+        setIndex(std::move(tmp));
+        assert(noDuplicates());
       }
     };
     
 
 }
+
+#ifdef CLASSDESC
+#pragma omit pack civita::Index
+#pragma omit unpack civita::Index
+#pragma omit json_pack civita::Index
+#pragma omit json_unpack civita::Index
+#pragma omit RESTProcess civita::Index
+#include <json_pack_base.h>
+#include <pack_base.h>
+// Index is serialised as its vector of hypercube indices. The
+// shared data and offset lookup cache are rebuilt when unpacked.
+namespace classdesc_access
+{
+  template <>
+  struct access_json_pack<civita::Index>
+  {
+    template <class T>
+    void operator()(classdesc::json_pack_t& j, const std::string& d, T& x)
+    {
+      std::vector<std::size_t> v(x.begin(),x.end());
+      classdesc::json_pack(j,d,v);
+    }
+  };
+  template <>
+  struct access_json_unpack<civita::Index>
+  {
+    template <class T>
+    void operator()(classdesc::json_unpack_t& j, const std::string& d, T& x)
+    {
+      std::vector<std::size_t> v;
+      classdesc::json_unpack(j,d,v);
+      x.setIndex(civita::Index::Impl(v.begin(),v.end()));
+    }
+  };
+  template <>
+  struct access_pack<civita::Index>
+  {
+    template <class T>
+    void operator()(classdesc::pack_t& b, const std::string& d, T& x)
+    {
+      std::vector<std::size_t> v(x.begin(),x.end());
+      classdesc::pack(b,d,v);
+    }
+  };
+  template <>
+  struct access_unpack<civita::Index>
+  {
+    template <class T>
+    void operator()(classdesc::pack_t& b, const std::string& d, T& x)
+    {
+      std::vector<std::size_t> v;
+      classdesc::unpack(b,d,v);
+      x.setIndex(civita::Index::Impl(v.begin(),v.end()));
+    }
+  };
+}
+#endif
+
 #endif
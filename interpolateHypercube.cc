@@ -18,6 +18,8 @@
 */
 
 #include "interpolateHypercube.h"
+#include "parallel.h"
+#include <numeric>
 #ifdef CLASSDESC
 #include <classdesc_epilogue.h>
 #endif
@@ -38,23 +40,35 @@ namespace civita
     }
   }
 
-  vector<size_t> InterpolateHC::splitAndRotate(size_t hcIndex) const
+  namespace
   {
-    vector<size_t> r(rank());
-    const auto& h=hypercube();
-    for (size_t dim=0; dim<rank(); ++dim)
-      r[rotation[dim]] = (hcIndex/strides[dim]) % h.xvectors[dim].size();
-    return r;
+    /// sorted labels of \a xv, along with their positions in \a xv
+    pair<XVector, vector<size_t>> sortedLabels(const XVector& xv)
+    {
+      pair<XVector, vector<size_t>> s;
+      for (size_t i=0; i<xv.size(); ++i)
+        s.second.push_back(i);
+      AnyLess less;
+      sort(s.second.begin(), s.second.end(),
+           [&](size_t i, size_t j){return less(xv[i],xv[j]);});
+      for (auto i: s.second)
+        s.first.push_back(xv[i]);
+      assert(sorted(s.first.begin(), s.first.end()));
+      return s;
+    }
   }
-
   
   void InterpolateHC::setArgument(const TensorPtr& a,  const Args&)
   {
     arg=a;
     if (rank()!=arg->rank())
       throw runtime_error("Rank of interpolated tensor doesn't match its argument");
+    // note this agorithm is limited in rank (typically 32 dims on 32bit machine, or 64 dims on 64bit)
+    if (rank()>=sizeof(size_t)*8)
+      throw runtime_error("Ranks >= "+to_string(sizeof(size_t)*8)+" not supported");
     // reorder hypercube for type and name
     interimHC.xvectors.clear();
+    strides.clear();
     size_t stride=1;
     const auto& targetHC=hypercube().xvectors;
     rotation.clear();
@@ -65,7 +79,6 @@ namespace civita
     for (size_t i=0; i<rank(); ++i)
       {
         const auto& src=arg->hypercube().xvectors[i];
-        sortAndAdd(src);
         if (src.name.empty())
           {
             const auto& dst=targetHC[i];
@@ -100,190 +113,351 @@ namespace civita
     for (auto& i: rotation) assert(i<rank()); // check that no indices have been doubly assigned.
     // Now we're sure rotation is a permutation
 #endif
-    if (index().empty())
-      for (size_t i=0; i<size(); checkCancel(), ++i)
-        weightedIndices.push_back(bodyCentredNeighbourhood(i));
-    else
-      for (auto i: index())
-        checkCancel(), weightedIndices.push_back(bodyCentredNeighbourhood(i));
+    auto dimsToInterpolate=min(maxInterpolateDimension, rank());
     argInterpolatedHCsize=interpolateHCSize=1;
     auto argDims=arg->hypercube().dims();
-    for (size_t dim=0; dim<min(maxInterpolateDimension, rank()); ++dim)
+    for (size_t dim=0; dim<dimsToInterpolate; ++dim)
       {
         interpolateHCSize*=targetHC[dim].size();
         argInterpolatedHCsize*=argDims[dim];
       }
-  }
 
-  void InterpolateHC::sortAndAdd(const XVector& xv)
-  {
-    sortedArgHC.emplace_back();
-    auto& s=sortedArgHC.back();
-    for (size_t i=0; i<xv.size(); ++i)
-      s.second.push_back(i);
-    AnyLess less;
-    sort(s.second.begin(), s.second.end(),
-         [&](size_t i, size_t j){return less(xv[i],xv[j]);});
-    for (auto i: s.second)
-      s.first.push_back(xv[i]);
-    assert(sorted(s.first.begin(), s.first.end()));
+    vector<size_t> destAxis(rank());
+    for (size_t i=0; i<rank(); ++i)
+      destAxis[rotation[i]]=i;
+    axisBrackets.clear();
+    axisBrackets.resize(dimsToInterpolate);
+    for (size_t dim=0, argStride=1; dim<dimsToInterpolate; argStride*=argDims[dim], ++dim)
+      {
+        auto& ab=axisBrackets[dim];
+        if (destAxis[dim]<dimsToInterpolate)
+          {
+            ab.stride=strides[destAxis[dim]];
+            ab.size=targetHC[destAxis[dim]].size();
+          }
+        auto& argXVectors=arg->hypercube().xvectors;
+        if (matchStringLabels && argXVectors.namedDimension(dim).dimension.type==Dimension::string)
+          {
+            for (auto& v: interimHC.xvectors[dim])
+              {
+                checkCancel();
+                Bracket b;
+                auto pos=argXVectors.position(dim,v);
+                b.lower=b.upper=pos*argStride;
+                if (pos==argXVectors.axisSize(dim)) b.lowerWeight=0; // label missing
+                ab.brackets.push_back(b);
+              }
+            continue;
+          }
+        
+        auto sortedArg=sortedLabels(argXVectors[dim]);
+        const auto& x=sortedArg.first;
+        if (x.empty()) continue; // no brackets, so no values
+
+        // visit destination labels in sorted order, so that brackets
+        // are found by a merge walk along the sorted argument labels
+        const auto& destXV=interimHC.xvectors[dim];
+        AnyLess less;
+        vector<size_t> order(destXV.size());
+        iota(order.begin(), order.end(), 0);
+        if (!is_sorted(destXV.cbegin(), destXV.cend(), less))
+          sort(order.begin(), order.end(),
+               [&](size_t i, size_t j){return less(destXV[i],destXV[j]);});
+        ab.brackets.resize(destXV.size());
+        size_t lesser=0; // greatest argument label <= v, or 0 if none
+        for (auto pos: order)
+          {
+            checkCancel();
+            auto& v=destXV[pos];
+            while (lesser+1<x.size() && !less(v, x[lesser+1])) ++lesser;
+            auto& b=ab.brackets[pos];
+            b.lower=b.upper=sortedArg.second[lesser]*argStride;
+            // one sided interpolation for beginning, end or exact match
+            if (lesser+1<x.size())
+              {
+                double dv=diff(v,x[lesser]);
+                if (dv<=0) continue;
+                double d=diff(x[lesser+1],x[lesser]);
+                if (d>0)
+                  {
+                    b.upper=sortedArg.second[lesser+1]*argStride;
+                    b.lowerWeight=(d-dv)/d;
+                    b.upperWeight=dv/d;
+                  }
+              }
+          }
+      }
+
+    sparseArg=!arg->index().empty();
+    setSparseWeights();
   }
 
-  
-  double InterpolateHC::operator[](size_t idx) const
+  template <class F>
+  bool InterpolateHC::forEachNeighbour(size_t idx, F f) const
   {
     auto div=lldiv(idx,interpolateHCSize);
-    if (size_t(div.rem)<weightedIndices.size())
+    size_t base=argInterpolatedHCsize*div.quot;
+    // axes along which this point lies strictly between two argument positions
+    const Bracket* between[sizeof(size_t)*8];
+    size_t numBetween=0;
+    for (size_t dim=0; dim<axisBrackets.size(); ++dim)
       {
-        if (weightedIndices[div.rem].empty()) return nan("");
-        double r=0;
-        for (const auto& i: weightedIndices[div.rem])
+        auto& ab=axisBrackets[dim];
+        size_t pos=ab.stride? (div.rem/ab.stride)%ab.size: 0;
+        if (pos>=ab.brackets.size()) return false;
+        auto& b=ab.brackets[pos];
+        if (b.upperWeight)
+          between[numBetween++]=&b;
+        else if (b.lowerWeight)
+          base+=b.lower;
+        else
+          return false; // no matching argument label
+      }
+    
+    // multivariate interpolation - eg see Abramowitz & Stegun 25.2.66
+    // sum over the corners of the hypercell containing this point
+    for (size_t corner=0; corner<(size_t(1)<<numBetween); ++corner)
+      {
+        double weight=1;
+        size_t argIdx=base;
+        for (size_t i=0; weight && i<numBetween; ++i)
+          if (corner&(size_t(1)<<i))
+            {
+              weight*=between[i]->upperWeight;
+              argIdx+=between[i]->upper;
+            }
+          else
+            {
+              weight*=between[i]->lowerWeight;
+              argIdx+=between[i]->lower;
+            }
+        if (weight)
           {
-            assert(i.index<arg->hypercube().numElements());
-            r+=i.weight * arg->atHCIndex(i.index+argInterpolatedHCsize*div.quot);
+            assert(argIdx<arg->hypercube().numElements());
+            if (!f(argIdx, weight)) return false;
           }
-        return r;
       }
-    return nan("");
+    return true;
   }
 
-  InterpolateHC::WeightedIndexVector InterpolateHC::bodyCentredNeighbourhood(size_t destIdx) const
+  void InterpolateHC::setSparseWeights()
   {
-    // note this agorithm is limited in rank (typically 32 dims on 32bit machine, or 64 dims on 64bit)
-    if (rank()>sizeof(size_t)*8)
-      throw runtime_error("Ranks > "+to_string(sizeof(size_t)*8)+" not supported");
-    auto dimsToInterpolate=min(maxInterpolateDimension,rank());
-    size_t numNeighbours=size_t(1)<<dimsToInterpolate;
-    vector<size_t> iIdx=splitAndRotate(destIdx);
-    const auto& argHC=arg->hypercube();
-    // loop over the nearest neighbours in argument hypercube space of
-    // this point in interimHypercube space
-    double sumWeight=0;
-    WeightedIndexVector r;
-    // multivariate interpolation - eg see Abramowitz & Stegun 25.2.66
-    for (size_t nbr=0; nbr<numNeighbours; ++nbr)
+    sparseDest.clear();
+    sparseStart.clear();
+    sparseSources.clear();
+    if (sparseResult) m_index.clear();
+    if (!sparseArg) return;
+    
+    auto& argIndex=arg->index();
+    auto argDims=arg->hypercube().dims();
+    auto numAxes=axisBrackets.size();
+    // destination positions along each interpolated axis whose
+    // brackets use each argument position
+    vector<vector<vector<size_t>>> users(numAxes);
+    for (size_t dim=0, argStride=1; dim<numAxes; argStride*=argDims[dim], ++dim)
       {
-        double weight=1;
-        size_t idx=0;
-        for (size_t dim=0, stride=1; dim<dimsToInterpolate; stride*=argHC.xvectors[dim].size(), ++dim)
+        auto& ab=axisBrackets[dim];
+        users[dim].resize(argDims[dim]);
+        size_t numPositions=ab.stride? ab.brackets.size(): min(ab.brackets.size(), size_t(1));
+        for (size_t pos=0; pos<numPositions; ++pos)
           {
-            const auto& x=sortedArgHC[dim].first;
-            assert(!x.empty());
-            assert(sorted(x.begin(),x.end()));
-            auto v=interimHC.xvectors[dim][iIdx[dim]];
-            auto lesserIt=std::upper_bound(x.begin(), x.end(), v, AnyLess());
-            if (lesserIt!=x.begin()) --lesserIt; // find greatest value <= v, 
-            any lesser=*lesserIt, greater;
-            if (diff(lesser, v)>=0)
-              greater=lesser;  // one sided interpolation for beginning or exact match 
-            else if (lesserIt+1==x.end())
-              greater=x.back(); // one sided interpolation for end
-            else
-              greater=*(lesserIt+1);
-
-            bool greaterSide = nbr&(size_t(1)<<dim); // on higher side of hypercube
-            double d=diff(greater,lesser);
-            if (d==0 && greaterSide) goto nextNeighbour; // already taken lesserVal at weight 1.
+            auto& b=ab.brackets[pos];
+            if (b.lowerWeight) users[dim][b.lower/argStride].push_back(pos);
+            if (b.upperWeight) users[dim][b.upper/argStride].push_back(pos);
+          }
+      }
 
-            idx += sortedArgHC[dim].second[(lesserIt-x.begin()+greaterSide)]*stride;
-            assert(idx<argHC.numElements());
-            if (d>0)
-              weight *= greaterSide? diff(v,lesser): d-diff(v,lesser);
+    // destination elements with at least one neighbour present,
+    // collected per chunk of the argument's index
+    auto numChunks=min(numThreads(), argIndex.size()/minParallelElements+1);
+    vector<vector<size_t>> chunkCandidates(numChunks);
+    parallelFor(numChunks, [&](size_t begin, size_t end) {
+      vector<const vector<size_t>*> positions(numAxes);
+      vector<size_t> counter(numAxes);
+      for (auto chunk=begin; chunk<end; ++chunk)
+        for (auto i=chunk*argIndex.size()/numChunks; i<(chunk+1)*argIndex.size()/numChunks;
+             checkCancel(), ++i)
+          {
+            auto& candidates=chunkCandidates[chunk];
+            auto div=lldiv(argIndex[i], argInterpolatedHCsize);
+            bool used=true;
+            for (size_t dim=0, rem=div.rem; dim<numAxes; rem/=argDims[dim], ++dim)
+              {
+                positions[dim]=&users[dim][rem%argDims[dim]];
+                used&=!positions[dim]->empty();
+              }
+            if (!used) continue;
+            // enumerate the product of positions along each axis
+            fill(counter.begin(), counter.end(), 0);
+            for (size_t dim=0; dim<numAxes; )
+              {
+                size_t destIdx=div.quot*interpolateHCSize;
+                for (size_t j=0; j<numAxes; ++j)
+                  destIdx+=(*positions[j])[counter[j]]*axisBrackets[j].stride;
+                candidates.push_back(destIdx);
+                for (dim=0; dim<numAxes && ++counter[dim]==positions[dim]->size(); ++dim)
+                  counter[dim]=0;
+              }
+            if (!numAxes) candidates.push_back(div.quot);
           }
-        if (index().empty())
+    });
+    vector<size_t> candidates;
+    for (auto& i: chunkCandidates)
+      {
+        candidates.insert(candidates.end(), i.begin(), i.end());
+        vector<size_t>().swap(i);
+      }
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+    // retain those elements whose neighbours are all present. The
+    // neighbours are counted, then filled in, so that the results
+    // can be written in parallel into preallocated storage.
+    auto argOffset=[&](size_t argIdx) {
+      auto it=lower_bound(argIndex.begin(), argIndex.end(), argIdx);
+      return it!=argIndex.end() && *it==argIdx? size_t(it-argIndex.begin()): argIndex.size();
+    };
+    vector<size_t> numSources(candidates.size()); // 0 if not all neighbours present
+    parallelFor(candidates.size(), [&](size_t begin, size_t end) {
+      for (auto i=begin; i<end; checkCancel(), ++i)
+        {
+          size_t count=0;
+          if (!forEachNeighbour(candidates[i], [&](size_t argIdx, double) {
+            ++count;
+            return argOffset(argIdx)<argIndex.size();
+          }))
+            count=0;
+          numSources[i]=count;
+        }
+    }, minParallelElements);
+
+    vector<size_t> sourceStart(candidates.size());
+    size_t total=0;
+    for (size_t i=0; i<candidates.size(); ++i)
+      if (numSources[i])
+        {
+          sparseDest.push_back(candidates[i]);
+          sparseStart.push_back(total);
+          sourceStart[i]=total;
+          total+=numSources[i];
+        }
+    sparseStart.push_back(total);
+    sparseSources.resize(total);
+    
+    parallelFor(candidates.size(), [&](size_t begin, size_t end) {
+      for (auto i=begin; i<end; checkCancel(), ++i)
+        if (numSources[i])
           {
-            r.emplace_back(WeightedIndex{idx,weight});
-            sumWeight+=weight;
+            auto source=sparseSources.begin()+sourceStart[i];
+            forEachNeighbour(candidates[i], [&](size_t argIdx, double weight) {
+              *source++={argOffset(argIdx), weight};
+              return true;
+            });
           }
-        else
+    }, minParallelElements);
+    
+    if (sparseResult && !sparseDest.empty())
+      m_index.assignVector(sparseDest);
+  }
+
+  double InterpolateHC::operator[](size_t idx) const
+  {
+    if (!arg) return nan("");
+    if (sparseArg)
+      {
+        size_t i=idx;
+        if (index().empty())
           {
-            auto indexV=index();
-            if (binary_search(indexV.begin(), indexV.end(), idx))
-              {
-                r.emplace_back(WeightedIndex{idx,weight});
-                sumWeight+=weight;
-              }
+            auto it=lower_bound(sparseDest.begin(), sparseDest.end(), idx);
+            if (it==sparseDest.end() || *it!=idx) return nan("");
+            i=it-sparseDest.begin();
           }
-      nextNeighbour:;
+        double r=0;
+        for (auto j=sparseStart[i]; j<sparseStart[i+1]; ++j)
+          r+=sparseSources[j].second * (*arg)[sparseSources[j].first];
+        return r;
       }
+    double r=0;
+    if (forEachNeighbour(idx, [&](size_t argIdx, double weight) {
+      r+=weight*arg->atHCIndex(argIdx);
+      return true;
+    }))
+      return r;
+    return nan("");
+  }
 
-    // normalise weights
-    for (auto& i: r) i.weight/=sumWeight;
-    return r;
+  void InterpolateHC::evaluate(double* dest) const
+  {
+    if (!sparseArg || !index().empty())
+      return ITensor::evaluate(dest);
+    fill(dest, dest+size(), nan(""));
+    for (size_t i=0; i<sparseDest.size(); ++i)
+      {
+        double r=0;
+        for (auto j=sparseStart[i]; j<sparseStart[i+1]; ++j)
+          r+=sparseSources[j].second * (*arg)[sparseSources[j].first];
+        dest[sparseDest[i]]=r;
+      }
   }
 
-  void PivotedInterpolateHC::setArgument(const TensorPtr& a, const ITensor::Args&)
+  namespace
+  {
+    /// interpolates string axes by matching labels, so that the
+    /// argument needn't be permuted first
+    struct LabelMatchedInterpolateHC: public InterpolateHC
+    {
+      LabelMatchedInterpolateHC(bool sparse) {matchStringLabels=true; sparseResult=sparse;}
+    };
+  }
+  
+  void PivotedInterpolateHC::setArgument(const TensorPtr& a, const ITensor::Args& args)
   {
     if (!a) return;
-    vector<string> initPivotOrder, finalPivotOrder, stringDims;
-    map<string, const XVector*> targetXVectors, argXVectors;
-    for (auto& i: a->hypercube().xvectors)
-      argXVectors[i.name]=&i;
+    auto& argXVectors=a->hypercube().xvectors;
+    map<string, size_t> argAxes;
+    for (size_t i=0; i<argXVectors.size(); ++i)
+      argAxes[argXVectors.namedDimension(i).name]=i;
 
-    TensorPtr chain=a;
     // note hypercube is currently set with the target Hypercube to interpolate argument
-    for (auto& xv: hypercube().xvectors)
+    Hypercube hc;
+    bool interpolate=false; // whether any non-string axis needs interpolating
+    auto& targetXVectors=hypercube().xvectors;
+    for (auto xvi=targetXVectors.begin(); xvi!=targetXVectors.end(); ++xvi)
       {
-        finalPivotOrder.push_back(xv.name);
-        targetXVectors[xv.name]=&xv;
-        auto& argXv=*argXVectors[xv.name];
-        if (xv==argXv)
-          stringDims.push_back(xv.name);
+        auto& xv=*xvi;
+        auto argAxis=argAxes.find(xv.name);
+        if (argAxis==argAxes.end())
+          throw runtime_error("axis "+xv.name+" not found in argument");
+        auto axis=argAxis->second;
+        if (xv==argXVectors[axis])
+          hc.xvectors.insert(hc.xvectors.end(), xvi, xvi+1);
         else if (xv.dimension.type==Dimension::string)
           {
-            stringDims.push_back(xv.name);
-            // need to permute arguments a's arguments to match that of xv
-            vector<size_t> permutation;
-            map<any, size_t> argSlices;
-            for (size_t i=0; i<argXv.size(); ++i)
-              argSlices.emplace(argXv[i], i);
+            // retain only the labels present in the argument
+            auto& trimmed=hc.xvectors.emplace_back(xv.name, xv.dimension);
             for (auto& i: xv)
+              if (argXVectors.position(axis,i)<argXVectors.axisSize(axis))
+                trimmed.push_back(i);
+            if (trimmed.empty())
               {
-                auto slice=argSlices.find(i);
-                if (slice!=argSlices.end())
-                  permutation.push_back(slice->second);
-              }
-            if (permutation.empty())
-              {
-                m_index=set<unsigned>{0}; // axes do not match, no data
+                // axes do not match, no data
+                auto noData=make_shared<TensorVal>(hypercube());
+                *noData=map<size_t,double>{{0,nan("")}};
+                Pivot::setArgument(noData,{});
                 return;
               }
-            auto permute=make_shared<PermuteAxis>();
-            permute->setArgument(chain,{argXv.name,0});
-            permute->setPermutation(permutation);
-            chain=std::move(permute);
           }
         else
-          initPivotOrder.push_back(xv.name);
-      }
-
-    size_t interpolateSize=initPivotOrder.size();
-    
-    initPivotOrder.insert(initPivotOrder.end(),stringDims.begin(),stringDims.end());
-    if (initPivotOrder!=finalPivotOrder)
-      {
-        auto initPivot=make_shared<Pivot>();
-        initPivot->setArgument(chain, {});
-        initPivot->setOrientation(initPivotOrder);
-        chain=std::move(initPivot);
-      }
-    
-    if (interpolateSize>0)
-      {
-        auto interpolate=make_shared<InterpolateHC>(interpolateSize);
-
-        Hypercube pivotedTargetHC;
-        // moved, because hypercube() recreated below
-        for (auto& i: initPivotOrder) pivotedTargetHC.xvectors.emplace_back(std::move(*targetXVectors[i]));
-        interpolate->hypercube(pivotedTargetHC);
-        interpolate->setArgument(chain,{});
-        Pivot::setArgument(interpolate,{}); // resets hypercube
+          {
+            interpolate=true;
+            hc.xvectors.insert(hc.xvectors.end(), xvi, xvi+1);
+          }
       }
-    else
-      Pivot::setArgument(chain, {});
-
-    if (initPivotOrder!=finalPivotOrder)
-      setOrientation(finalPivotOrder);
+    // as before fusing, only an interpolated result is dense
+    auto interpolateOp=make_shared<LabelMatchedInterpolateHC>(!interpolate);
+    interpolateOp->hypercube(std::move(hc));
+    interpolateOp->setArgument(a, args);
+    Pivot::setArgument(interpolateOp,{}); // resets hypercube, in target order
   }
   
 }
@@ -28,39 +28,50 @@ namespace civita
   /// rank must equal arg->rank(), and xvectors type must match
   class InterpolateHC: public ITensor
   {
-    TensorPtr arg;
     /// hypercube that's been rotated to match the arguments hypercube
     Hypercube interimHC;
     std::vector<std::size_t> strides; ///<strides along each dimension of this->hypercube()
     std::vector<std::size_t> rotation; ///< permutation of axes of interimHC and this->hypercube()
-    
-    std::vector<std::pair<XVector, std::vector<std::size_t>>> sortedArgHC;
-    void sortAndAdd(const XVector&);
 
-    //
-    vector<std::size_t> splitAndRotate(std::size_t) const;
-    
-    /// structure for referring to an argument index and its weight 
-    struct WeightedIndex
+    /// positions bracketing a destination coordinate along an argument axis
+    struct Bracket
     {
-      std::size_t index;
-      double weight;
-      WeightedIndex(std::size_t index,double weight): index(index), weight(weight) {}
+      std::size_t lower, upper; ///< argument hypercube offsets of the bracketing positions
+      double lowerWeight=1, upperWeight=0; ///< upperWeight is 0 if only lower is used
     };
 
-    struct WeightedIndexVector: public vector<WeightedIndex>
+    /// linear interpolation is separable, so is described by brackets
+    /// along each interpolated argument axis
+    struct AxisBrackets
     {
-      bool argIsOnDestHypercube=false;
+      /// stride and size of the corresponding destination axis. A
+      /// stride of 0 means the destination position is always 0
+      std::size_t stride=0, size=1;
+      std::vector<Bracket> brackets; ///< indexed by destination position
     };
-  
-    /// map from this tensor's index into the argument tensor
-    vector<WeightedIndexVector> weightedIndices;
+    std::vector<AxisBrackets> axisBrackets;
+
+    /// calls f(argument hypercube index, weight) for each weighted
+    /// neighbour of destination element \a idx, stopping if f returns false
+    /// @return false if stopped, or \a idx has no neighbours
+    template <class F> bool forEachNeighbour(std::size_t idx, F f) const;
 
-    /// computes the neighbourhood around a target argument index when
-    /// the target index is not on the hypercube
-    WeightedIndexVector bodyCentredNeighbourhood(std::size_t idx) const;
+    /// when the argument is sparse, destination elements whose
+    /// neighbours are all present, in sorted order, along with the
+    /// (argument offset, weight) of their neighbours.
+    bool sparseArg=false;
+    std::vector<std::size_t> sparseDest, sparseStart;
+    std::vector<std::pair<std::size_t,double>> sparseSources;
+    void setSparseWeights();
 
     size_t maxInterpolateDimension, interpolateHCSize, argInterpolatedHCsize;
+  protected:
+    TensorPtr arg;
+    /// if true, string axes are aligned by label, rather than interpolated
+    bool matchStringLabels=false;
+    /// if true, a sparse argument gives a sparse result, containing
+    /// the elements whose neighbours are all present
+    bool sparseResult=false;
   public:
     /// interpolates the sub-hypercube given by the first maxInterpolateDimension axes.
     /// if maxInterpolateDimension>=rank(), then the whole hypercube is interpolated
@@ -68,10 +79,18 @@ namespace civita
       maxInterpolateDimension(maxInterpolateDimension) {}
     void setArgument(const TensorPtr& a, const ITensor::Args&) override;
     double operator[](std::size_t) const override;
+    /// when the argument is sparse, only elements with neighbours are evaluated
+    void evaluate(double* dest) const override;
     Timestamp timestamp() const override {return arg? arg->timestamp(): Timestamp();}
   };
 
-  /// pivots the string dimensions to the end, interpolates over the non-string dimensions, then pivots back
+  /// pivots the string dimensions to the end, interpolates over the
+  /// non-string dimensions, then pivots back. String dimensions are
+  /// aligned by label, dropping labels not present in the argument,
+  /// and the interpolation is done in a single step, so the pivots
+  /// are not materialised. The result is sparse if the argument is
+  /// sparse and no dimension needs interpolating.
+  /// @throw std::runtime_error if a target axis is not present in the argument
   class PivotedInterpolateHC: public Pivot
   {
   public:
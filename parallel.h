@@ -0,0 +1,97 @@
+/*
+  @copyright Russell Standish 2026
+  @author Russell Standish
+  This file is part of Civita.
+
+  Civita is free software: you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  Civita is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with Civita.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CIVITA_PARALLEL_H
+#define CIVITA_PARALLEL_H
+#include "index.h"
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace civita
+{
+  /// number of elements below which it is not worth starting a thread
+  constexpr std::size_t minParallelElements=1<<16;
+  
+  /// number of threads used by parallelFor
+  inline std::size_t numThreads()
+  {return std::max(1U, std::thread::hardware_concurrency());}
+  
+  /// true whilst the current thread is executing a parallelFor subrange
+  inline bool& inParallelFor()
+  {
+    thread_local bool inside=false;
+    return inside;
+  }
+  
+  /// calls f(begin,end) on contiguous subranges partitioning [0,n),
+  /// in parallel. Subranges contain at least \a minChunk elements, so
+  /// small ranges are processed in the calling thread.  The first
+  /// exception thrown by \a f is rethrown in the calling thread. Any
+  /// MemoryAttribution scope of the calling thread applies to the workers.
+  /// Nested calls, made from within \a f, run serially, as the threads
+  /// are already occupied by the outer call.
+  template <class F>
+  void parallelFor(std::size_t n, F f, std::size_t minChunk=1)
+  {
+    auto nThreads=inParallelFor()? 1:
+      std::min(numThreads(), n/std::max(minChunk,std::size_t(1)));
+    if (nThreads<=1)
+      {
+        if (n) f(std::size_t(0),n);
+        return;
+      }
+    std::size_t chunk=(n+nThreads-1)/nThreads;
+    std::exception_ptr exception;
+    std::mutex exceptionMutex;
+    auto attribution=MemoryAttribution::current();
+    auto run=[&](std::size_t begin) {
+      try
+        {
+          // attribute the worker's allocations as for the calling thread
+          std::optional<MemoryAttribution> workerAttribution;
+          if (attribution)
+            workerAttribution.emplace(*attribution);
+          struct InParallelFor
+          {
+            bool prev=inParallelFor();
+            InParallelFor() {inParallelFor()=true;}
+            ~InParallelFor() {inParallelFor()=prev;}
+          } inside;
+          f(begin, std::min(n, begin+chunk));
+        }
+      catch (...)
+        {
+          std::lock_guard<std::mutex> lock(exceptionMutex);
+          if (!exception) exception=std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (std::size_t begin=chunk; begin<n; begin+=chunk)
+      threads.emplace_back(run, begin);
+    run(0);
+    for (auto& i: threads) i.join();
+    if (exception) std::rethrow_exception(exception);
+  }
+}
+
+#endif
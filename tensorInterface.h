@@ -27,6 +27,7 @@
 #endif
 #include <atomic>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 #include <set>
 
@@ -58,11 +59,13 @@ namespace civita
     /// impose dimensions according to dimension map \a dimensions
     void imposeDimensions(const Dimensions& dimensions) {
       auto hc=hypercube();
-      for (auto& xv: hc.xvectors)
+      // only axes that are modified are detached from the original hypercube
+      for (std::size_t i=0; i<hc.rank(); ++i)
         {
-          auto dim=dimensions.find(xv.name);
+          auto dim=dimensions.find(hc.xvectors[i].name);
           if (dim!=dimensions.end())
             {
+              auto& xv=hc.xvectors.mutableAxis(i);
               xv.dimension=dim->second;
               xv.imposeDimension();
             }
@@ -78,11 +81,24 @@ namespace civita
     double at(std::size_t i) const {return (*this)[i];}
     /// return vector of data ([0]..[size()-1])
     std::vector<double> data() const {
-      std::vector<double> r; r.reserve(size());
-      for (size_t i=0; i<size(); ++i)
-        r.push_back(at(i));
+      std::vector<double> r(size());
+      evaluate(r.data());
       return r;
     }
+    /// evaluate all data ([0]..[size()-1]) into \a dest, which must
+    /// have room for size() elements. Overridden by operations with a
+    /// more efficient bulk evaluation than elementwise operator[]
+    virtual void evaluate(double* dest) const {
+      if (auto d=contiguousData())
+        {
+          if (d!=dest) std::memcpy(dest, d, sizeof(double)*size());
+        }
+      else
+        for (std::size_t i=0; i<size(); ++i)
+          dest[i]=(*this)[i];
+    }
+    /// data ([0]..[size()-1]) if stored contiguously, nullptr otherwise
+    virtual const double* contiguousData() const {return nullptr;}
     /// return number of elements in tensor - maybe less than hypercube.numElements if sparse
     virtual std::size_t size() const {
       std::size_t s=index().size();
@@ -166,6 +182,8 @@ namespace civita
     const Hypercube& hypercube(Hypercube&& hc) override {return ref.hypercube(std::move(hc));}
     const Index& index() const override {return ref.index();}
     double operator[](std::size_t i) const override {return ref[i];}
+    void evaluate(double* dest) const override {ref.evaluate(dest);}
+    const double* contiguousData() const override {return ref.contiguousData();}
     std::size_t size() const override {return ref.size();}
     civita::ITensor::Timestamp timestamp() const override {return ref.timestamp();}
   };
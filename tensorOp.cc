@@ -18,9 +18,13 @@
 */
 
 #include "tensorOp.h"
+#include "parallel.h"
 #include <algorithm>
 #include <exception>
+#include <numeric>
+#include <queue>
 #include <set>
+#include <typeinfo>
 using namespace std;
 
 #ifdef CLASSDESC
@@ -30,6 +34,28 @@ using namespace std;
 namespace civita
 {
   std::atomic<bool> ITensor::s_cancel{false};
+
+  namespace
+  {
+    /// data of a dense tensor, evaluated into a buffer if not stored contiguously
+    class DenseData
+    {
+      std::vector<double> buffer;
+      const double* m_data;
+    public:
+      DenseData(const ITensor& x): m_data(x.contiguousData()) {
+        if (!m_data)
+          {
+            buffer=x.data();
+            m_data=buffer.data();
+          }
+      }
+      const double* data() const {return m_data;}
+    };
+
+    /// tile size for blocked transposes - a tile of doubles fits in L1 cache
+    const size_t transposeBlock=32;
+  }
   
   void BinOp::setArguments(const TensorPtr& a1, const TensorPtr& a2, const Args&)
   {
@@ -125,13 +151,13 @@ namespace civita
       {
         const auto& ahc=arg->hypercube();
         m_hypercube=ahc;
-        auto& xv=m_hypercube.xvectors;
+        auto& xv=ahc.xvectors;
         for (auto i=xv.begin(); i!=xv.end(); ++i)
           if (i->name==args.dimension)
             dimension=i-xv.begin();
         if (dimension<arg->rank())
           {
-            xv.erase(xv.begin()+dimension);
+            m_hypercube.xvectors.erase(m_hypercube.xvectors.begin()+dimension);
             // compute index - enter index elements that have any in the argument
             set<size_t> indices;
             for (size_t i=0; i<arg->size(); checkCancel(), ++i)
@@ -200,6 +226,7 @@ namespace civita
     {
       lock_guard<decltype(computeTensorMutex)> lock(computeTensorMutex);
       if (m_timestamp<timestamp()) {
+        MemoryAttribution attribution(typeid(*this), this);
         computeTensor();
         m_timestamp=Timestamp::clock::now();
       }
@@ -213,12 +240,11 @@ namespace civita
     argVal=args.val;
     if (!arg) {m_hypercube.xvectors.clear(); return;}
     dimension=std::numeric_limits<size_t>::max();
-    auto hc=arg->hypercube();
-    auto& xv=hc.xvectors;
+    auto& xv=arg->hypercube().xvectors;
     for (auto i=xv.begin(); i!=xv.end(); ++i)
       if (i->name==args.dimension)
         dimension=i-xv.begin();
-    hypercube(std::move(hc));
+    hypercube(arg->hypercube());
   }
 
   
@@ -272,7 +298,7 @@ namespace civita
     if (arg)
       {
         auto& xv=arg->hypercube().xvectors;
-        Hypercube hc;
+        Hypercube hc=arg->hypercube();
         // find axis where slicing along
         split=1;
         auto i=xv.begin();
@@ -283,18 +309,43 @@ namespace civita
               break;
             }
           else
-            {
-              hc.xvectors.push_back(*i);
-              split*=i->size();
-            }
+            split*=i->size();
 
-        if (i==xv.end())
+        bool sliceAxisFound=i!=xv.end();
+        if (!sliceAxisFound)
           split=stride=1;
         else
-          for (i++; i!=xv.end(); ++i)
-            // finish building hypercube
-            hc.xvectors.push_back(*i);
-        hypercube(hc);
+          hc.xvectors.erase(hc.xvectors.begin()+(i-xv.begin()));
+        hypercube(std::move(hc));
+
+        m_index.clear();
+        arg_index.clear();
+        auto& argIndex=arg->index();
+        if (sliceAxisFound && !argIndex.empty())
+          {
+            // Elements of the slice form a contiguous run within each
+            // stride of the sorted argument index, so binary search
+            // for each run, skipping strides containing no data.
+            Index::Impl index;
+            auto begin=argIndex.begin(), end=argIndex.end();
+            for (auto j=begin; j!=end; checkCancel())
+              {
+                size_t base=*j-*j%stride;
+                size_t runStart=base+sliceIndex*split;
+                auto runBegin=lower_bound(j, end, runStart);
+                auto runEnd=lower_bound(runBegin, end, runStart+split);
+                for (auto k=runBegin; k!=runEnd; ++k)
+                  {
+                    index.push_back(base/stride*split + *k-runStart);
+                    arg_index.push_back(k-begin);
+                  }
+                j=lower_bound(runEnd, end, base+stride);
+              }
+            // an empty index would be interpreted as dense, so
+            // retain the dense evaluation when nothing is selected
+            if (!index.empty())
+              m_index.assignVector(std::move(index));
+          }
       }
   }
 
@@ -322,13 +373,14 @@ namespace civita
   void Pivot::setOrientation(const vector<string>& axes)
   {
     map<string,size_t> pMap;
-    map<string,XVector> xVectorMap;
     auto& ahc=arg->hypercube();
     for (size_t i=0; i<ahc.xvectors.size(); checkCancel(), ++i)
-      {
-        pMap[ahc.xvectors[i].name]=i;
-        xVectorMap[ahc.xvectors[i].name]=ahc.xvectors[i];
-      }
+      pMap[ahc.xvectors[i].name]=i;
+    // axes of hc share their labels with the argument's
+    auto pushAxis=[&](Hypercube& hc, size_t i) {
+      auto xv=ahc.xvectors.begin()+i;
+      hc.xvectors.insert(hc.xvectors.end(), xv, xv+1);
+    };
     Hypercube hc;
     permutation.clear();
     set<string> axisSet;
@@ -341,7 +393,7 @@ namespace civita
           throw runtime_error("axis "+i+" not found in argument");
         invPermutation[v->second]=permutation.size();
         permutation.push_back(v->second);
-        hc.xvectors.push_back(xVectorMap[i]);
+        pushAxis(hc, v->second);
       }
     // add remaining axes to permutation in found order
     for (size_t i=0; i<ahc.xvectors.size(); checkCancel(), ++i)
@@ -350,27 +402,35 @@ namespace civita
           {
             invPermutation[i]=permutation.size();
             permutation.push_back(i);
-            hc.xvectors.push_back(ahc.xvectors[i]);
+            pushAxis(hc, i);
           }
       }
 
     assert(hc.rank()==arg->rank());
     hypercube(std::move(hc));
     // permute the index vector
-    vector<pair<size_t, size_t>> pi;
-    for (size_t i=0; i<arg->index().size(); ++i)
-      {
-        auto idx=arg->hypercube().splitIndex(arg->index()[i]);
-        auto pidx=idx;
-        for (size_t j=0; j<idx.size(); checkCancel(), ++j)
-          {
-            assert(invPermutation.count(j));
-            assert(invPermutation[j]<pidx.size());
-            pidx[invPermutation[j]]=idx[j];
-          }
-        auto l=hypercube().linealIndex(pidx);
-        pi.emplace_back(l,i);
-      }
+    auto argDims=ahc.dims();
+    vector<size_t> strides(hypercube().rank()), pivotStrides(argDims.size());
+    for (size_t i=0, stride=1; i<strides.size(); stride*=hypercube().xvectors[i].size(), ++i)
+      strides[i]=stride;
+    for (auto& i: invPermutation)
+      pivotStrides[i.first]=strides[i.second];
+    auto& argIndex=arg->index();
+    vector<pair<size_t, size_t>> pi(argIndex.size());
+    parallelFor(pi.size(), [&](size_t begin, size_t end) {
+      for (size_t i=begin; i<end; checkCancel(), ++i)
+        {
+          size_t argIdx=argIndex[i], l=0;
+          for (size_t j=0; j<argDims.size(); ++j)
+            {
+              auto res=ldiv(argIdx, argDims[j]);
+              l+=res.rem*pivotStrides[j];
+              argIdx=res.quot;
+            }
+          pi[i]={l,i};
+        }
+    }, minParallelElements);
+    radixSort(pi);
     m_index.assignVector(pi);
     assert(m_index.noDuplicates());
     // convert to lineal indexing
@@ -396,42 +456,156 @@ namespace civita
     return i<permutedIndex.size()? (*arg)[permutedIndex[i]]: nan("");
   }
 
+  void Pivot::evaluate(double* dest) const
+  {
+    if (!index().empty() || !arg->index().empty() || permutation.empty())
+      return ITensor::evaluate(dest);
+    DenseData argData(*arg);
+    transpose(dest, argData.data());
+  }
+
+  void Pivot::transpose(double* dest, const double* src) const
+  {
+    auto srcDims=arg->hypercube().dims();
+    auto rank=srcDims.size();
+    vector<size_t> srcStrides(rank), destDims(rank), destStrides(rank), strides(rank);
+    for (size_t i=0, stride=1; i<rank; stride*=srcDims[i], ++i)
+      srcStrides[i]=stride;
+    size_t innermost=0; // axis of this that is the argument's innermost axis
+    for (size_t i=0, stride=1; i<rank; stride*=destDims[i], ++i)
+      {
+        destDims[i]=srcDims[permutation[i]];
+        destStrides[i]=stride;
+        strides[i]=srcStrides[permutation[i]]; // argument stride along axis i of this
+        if (permutation[i]==0) innermost=i;
+      }
+    size_t numElements=hypercube().numElements();
+    if (!numElements) return;
+
+    // axes other than the innermost axes of this and the argument
+    vector<size_t> outerAxes;
+    for (size_t i=1; i<rank; ++i)
+      if (i!=innermost)
+        outerAxes.push_back(i);
+    auto outerOffsets=[&](size_t outerIdx, size_t& destOffset, size_t& srcOffset) {
+      destOffset=srcOffset=0;
+      for (auto i: outerAxes)
+        {
+          auto res=ldiv(outerIdx, destDims[i]);
+          destOffset+=res.rem*destStrides[i];
+          srcOffset+=res.rem*strides[i];
+          outerIdx=res.quot;
+        }
+    };
+
+    size_t n0=destDims[0], nk=destDims[innermost];
+    if (innermost==0)
+      {
+        // innermost axes coincide, so copy contiguous runs
+        parallelFor(numElements/n0, [&](size_t begin, size_t end) {
+          for (size_t o=begin; o<end; checkCancel(), ++o)
+            {
+              size_t destOffset, srcOffset;
+              outerOffsets(o, destOffset, srcOffset);
+              memcpy(dest+destOffset, src+srcOffset, n0*sizeof(double));
+            }
+        }, minParallelElements/n0);
+        return;
+      }
+
+    // transpose the innermost axes in tiles, so both reads and
+    // writes within a tile are cache friendly. Each work item is a strip
+    // of tiles along the innermost axis of this.
+    const size_t block=transposeBlock;
+    size_t numStrips=(nk+block-1)/block, kStride=destStrides[innermost];
+    parallelFor(numElements/(n0*nk)*numStrips, [&](size_t begin, size_t end) {
+      for (size_t w=begin; w<end; checkCancel(), ++w)
+        {
+          auto res=ldiv(w, numStrips);
+          size_t destOffset, srcOffset;
+          outerOffsets(res.quot, destOffset, srcOffset);
+          size_t k0=res.rem*block, k1=min(nk, k0+block);
+          for (size_t i0=0; i0<n0; i0+=block)
+            for (size_t i=i0; i<min(n0, i0+block); ++i)
+              {
+                auto s=src+srcOffset+i*strides[0];
+                auto d=dest+destOffset+i;
+                for (size_t k=k0; k<k1; ++k)
+                  d[k*kStride]=s[k];
+              }
+        }
+    }, minParallelElements/(n0*block));
+  }
+
   
   void PermuteAxis::setArgument(const TensorPtr& a,const Args& args)
   {
     arg=a;
     hypercube(arg->hypercube());
     m_index=arg->index();
-    if (m_hypercube.xvectors.size()!=1) // ignore named axis for vectors
-      for (m_axis=0; m_axis<m_hypercube.xvectors.size(); ++m_axis)
-        if (m_hypercube.xvectors[m_axis].name==args.dimension)
+    m_axis=0;
+    // const access, so that axes remain shared with the argument
+    auto& xvectors=std::as_const(m_hypercube.xvectors);
+    if (xvectors.size()!=1) // ignore named axis for vectors
+      for (; m_axis<xvectors.size(); ++m_axis)
+        if (xvectors[m_axis].name==args.dimension)
           break;
-    if (m_axis==m_hypercube.xvectors.size())
+    if (m_axis==xvectors.size())
       throw runtime_error("axis "+args.dimension+" not found");
-    for (size_t i=0; i<m_hypercube.xvectors[m_axis].size(); ++i)
-      m_permutation.push_back(i);
+    vector<size_t> permutation(xvectors[m_axis].size());
+    iota(permutation.begin(), permutation.end(), 0);
+    setPermutation(std::move(permutation));
   }
 
   void PermuteAxis::setPermutation(vector<size_t>&& p)
   {
     m_permutation=std::move(p);
-    auto& xv=m_hypercube.xvectors[m_axis];
-    xv.clear();
     auto& axv=arg->hypercube().xvectors[m_axis];
+    // replace rather than clear the axis, to avoid copying the argument's labels
+    XVector permuted(axv.name, axv.dimension);
+    stride=1;
+    for (size_t i=0; i<m_axis; ++i)
+      stride*=arg->hypercube().xvectors[i].size();
+    argStride=stride*axv.size();
+    offsets.clear();
     for (auto i: m_permutation)
       if (i<axv.size())
-        checkCancel(), xv.push_back(axv[i]);
-    map<unsigned,unsigned> reverseIndex;
-    for (size_t i=0; i<m_permutation.size(); checkCancel(), ++i)
-      reverseIndex[m_permutation[i]]=i;
-    vector<pair<size_t,size_t>> indices;
-    for (size_t i=0; i<arg->index().size(); checkCancel(), ++i)
+        {
+          checkCancel();
+          permuted.push_back(axv[i]);
+          offsets.push_back(i*stride);
+        }
+    m_hypercube.xvectors.replace(m_axis, std::move(permuted));
+    auto& xv=std::as_const(m_hypercube.xvectors)[m_axis];
+    auto& argIndex=arg->index();
+    if (argIndex.empty())
       {
-        auto splitted=arg->hypercube().splitIndex(arg->index()[i]);
-        auto ri=reverseIndex.find(splitted[m_axis]);
-        if (ri!=reverseIndex.end() && (splitted[m_axis]=ri->second)<axv.size())
-          indices.emplace_back(hypercube().linealIndex(splitted),i);
+        m_index.clear();
+        permutedIndex.clear();
+        return;
       }
+    
+    // position along the permuted axis, indexed by argument position
+    static const size_t npos=numeric_limits<size_t>::max();
+    vector<size_t> reverseIndex(axv.size(), npos);
+    for (size_t i=0, pos=0; i<m_permutation.size(); checkCancel(), ++i)
+      if (m_permutation[i]<axv.size())
+        reverseIndex[m_permutation[i]]=pos++;
+    // lineal index, or npos for elements not selected by the permutation
+    vector<pair<size_t,size_t>> indices(argIndex.size());
+    parallelFor(indices.size(), [&](size_t begin, size_t end) {
+      for (size_t i=begin; i<end; checkCancel(), ++i)
+        {
+          auto lower=ldiv(argIndex[i], stride);
+          auto upper=ldiv(lower.quot, axv.size());
+          auto pos=reverseIndex[upper.rem];
+          indices[i]={pos==npos? npos: lower.rem+stride*(pos+xv.size()*upper.quot), i};
+        }
+    }, minParallelElements);
+    indices.erase(remove_if(indices.begin(), indices.end(),
+                            [](const pair<size_t,size_t>& i){return i.first==npos;}),
+                  indices.end());
+    radixSort(indices);
     m_index.assignVector(indices);
     permutedIndex.clear();
     for (auto& i: indices) checkCancel(), permutedIndex.push_back(i.second);
@@ -442,10 +616,131 @@ namespace civita
     assert(i<size());
     if (index().empty())
       {
-        auto splitted=hypercube().splitIndex(i);
-        if (m_axis>=splitted.size()) return nan("");
-        splitted[m_axis]=m_permutation[splitted[m_axis]];
-        return arg->atHCIndex(arg->hypercube().linealIndex(splitted));
+        if (offsets.empty()) return nan("");
+        auto lower=ldiv(i, stride);
+        auto upper=ldiv(lower.quot, offsets.size());
+        return arg->atHCIndex(lower.rem+offsets[upper.rem]+upper.quot*argStride);
+      }
+    return (*arg)[permutedIndex[i]];
+  }
+
+  void PermuteAxis::evaluate(double* dest) const
+  {
+    if (!size()) return;
+    if (!index().empty() || !arg->index().empty() || offsets.empty())
+      return ITensor::evaluate(dest);
+    DenseData argData(*arg);
+    auto src=argData.data();
+    // each row is a contiguous run of stride elements, at a single
+    // position along the permuted axis
+    size_t numRows=size()/stride;
+    parallelFor(numRows, [&](size_t begin, size_t end) {
+      for (size_t row=begin; row<end; checkCancel(), ++row)
+        {
+          auto res=ldiv(row, offsets.size());
+          auto s=src+offsets[res.rem]+res.quot*argStride;
+          if (stride==1)
+            dest[row]=*s;
+          else
+            memcpy(dest+row*stride, s, stride*sizeof(double));
+        }
+    }, minParallelElements/stride);
+  }
+
+  void Dice::setArgument(const TensorPtr& a,const Args&)
+  {
+    arg=a;
+    setSelection({});
+  }
+
+  void Dice::setSelection(const map<string,vector<size_t>>& selection)
+  {
+    if (!arg) return;
+    const auto& ahc=arg->hypercube();
+    for (auto& i: selection)
+      if (find_if(ahc.xvectors.begin(), ahc.xvectors.end(),
+                  [&](const XVector& xv){return xv.name==i.first;})==ahc.xvectors.end())
+        throw runtime_error("axis "+i.first+" not found");
+    
+    static const size_t npos=numeric_limits<size_t>::max();
+    Hypercube hc(ahc); // unselected axes are shared with the argument
+    offsets.clear();
+    offsets.resize(ahc.rank());
+    // position along each axis of this, indexed by argument position, or npos if not selected
+    vector<vector<size_t>> reverseIndex(ahc.rank());
+    size_t stride=1;
+    for (size_t axis=0; axis<ahc.rank(); stride*=ahc.xvectors[axis].size(), ++axis)
+      {
+        auto& axv=ahc.xvectors[axis];
+        auto& reverse=reverseIndex[axis];
+        reverse.resize(axv.size(), npos);
+        auto sel=selection.find(axv.name);
+        if (sel==selection.end())
+          {
+            for (size_t j=0; j<axv.size(); ++j)
+              {
+                reverse[j]=j;
+                offsets[axis].push_back(j*stride);
+              }
+            continue;
+          }
+        XVector xv(axv.name, axv.dimension);
+        for (auto j: sel->second)
+          if (j<axv.size())
+            {
+              checkCancel();
+              if (reverse[j]!=npos)
+                throw runtime_error("position "+to_string(j)+" repeated in selection along "+axv.name);
+              reverse[j]=offsets[axis].size();
+              offsets[axis].push_back(j*stride);
+              xv.push_back(axv[j]);
+            }
+        hc.xvectors.replace(axis, std::move(xv));
+      }
+    hypercube(std::move(hc));
+
+    m_index.clear();
+    permutedIndex.clear();
+    auto& argIndex=arg->index();
+    if (argIndex.empty()) return;
+    vector<pair<size_t,size_t>> indices;
+    for (size_t i=0; i<argIndex.size(); checkCancel(), ++i)
+      {
+        size_t argIdx=argIndex[i], idx=0, axis=0;
+        for (size_t stride=1; axis<reverseIndex.size(); stride*=offsets[axis].size(), ++axis)
+          {
+            auto& reverse=reverseIndex[axis];
+            auto res=ldiv(argIdx, reverse.size());
+            if (reverse[res.rem]==npos) break;
+            idx+=reverse[res.rem]*stride;
+            argIdx=res.quot;
+          }
+        if (axis==reverseIndex.size()) // element selected
+          indices.emplace_back(idx,i);
+      }
+    // selections need not be in argument order
+    if (!is_sorted(indices.begin(), indices.end()))
+      radixSort(indices);
+    // an empty index would be interpreted as dense, so retain dense
+    // evaluation when nothing is selected
+    if (indices.empty()) return;
+    m_index.assignVector(indices);
+    for (auto& i: indices) permutedIndex.push_back(i.second);
+  }
+
+  double Dice::operator[](size_t i) const
+  {
+    assert(i<size());
+    if (index().empty())
+      {
+        size_t argIdx=0;
+        for (auto& o: offsets)
+          {
+            auto res=ldiv(i, o.size());
+            argIdx+=o[res.rem];
+            i=res.quot;
+          }
+        return arg->atHCIndex(argIdx);
       }
     return (*arg)[permutedIndex[i]];
   }
@@ -479,12 +774,16 @@ namespace civita
     if (!arg) return;
     auto& aIdx=arg->index();
     if (arg->index().empty()) return;
+    if (numSpreadElements==0) {m_index.clear(); return;}
     if (numSpreadElements==1) {m_index=aIdx; return;}
-    set<size_t> idx;
-    for (auto i: aIdx)
-      for (size_t j=0; j<numSpreadElements; checkCancel(), ++j)
-        idx.insert(j+i*numSpreadElements);
-    m_index=idx;
+    // spread positions vary fastest, so the product is generated in sorted order
+    Index::Impl idx(aIdx.size()*numSpreadElements);
+    parallelFor(aIdx.size(), [&](size_t begin, size_t end) {
+      for (size_t i=begin; i<end; checkCancel(), ++i)
+        iota(idx.begin()+i*numSpreadElements, idx.begin()+(i+1)*numSpreadElements,
+             aIdx[i]*numSpreadElements);
+    }, minParallelElements/numSpreadElements+1);
+    m_index.assignVector(std::move(idx));
   }
 
   void SpreadLast::setIndex()
@@ -493,13 +792,20 @@ namespace civita
     auto& aIdx=arg->index();
     if (arg->index().empty()) return;
     size_t numToSpread=1;
-    set<size_t> idx;
     for (auto i=arg->rank(); i<rank(); ++i) numToSpread*=m_hypercube.xvectors[i].size();
     if (numToSpread==1) {m_index=aIdx; return;}
-    for (size_t i=0; i<numToSpread; ++i)
-      for (auto j: aIdx)
-        checkCancel(), idx.insert(j+i*numSpreadElements);
-    m_index=idx;
+    // argument indices vary fastest, and are less than
+    // numSpreadElements, so the product is generated in sorted order
+    Index::Impl idx(aIdx.size()*numToSpread);
+    parallelFor(numToSpread, [&](size_t begin, size_t end) {
+      for (size_t i=begin; i<end; checkCancel(), ++i)
+        {
+          auto dest=idx.begin()+i*aIdx.size();
+          for (auto j: aIdx)
+            *dest++=j+i*numSpreadElements;
+        }
+    }, minParallelElements/aIdx.size()+1);
+    m_index.assignVector(std::move(idx));
   }
 
 
@@ -512,34 +818,76 @@ namespace civita
         throw std::runtime_error("mismatch of dimensions");
 
     arg=a;
-    permutations.clear();
-    permutations.resize(a->rank());
-    for (size_t i=0; i<a->rank(); ++i)
+    offsets.clear();
+    offsets.resize(a->rank());
+    size_t stride=1;
+    auto& argXVectors=a->hypercube().xvectors;
+    for (size_t i=0; i<a->rank(); stride*=argXVectors.axisSize(i), ++i)
+      for (auto& label: hypercube().xvectors[i])
+        {
+          checkCancel();
+          auto pos=argXVectors.position(i,label);
+          offsets[i].push_back(pos<argXVectors.axisSize(i)? pos*stride: missing);
+        }
+  }
+
+  double SpreadOverHC::operator[](size_t idx) const {
+    auto h=index()[idx];
+    size_t argIdx=0;
+    for (auto& o: offsets)
       {
-        map<any,size_t> srcIndices;
-        for (size_t j=0; j<a->hypercube().xvectors[i].size(); checkCancel(), ++j)
-          srcIndices[a->hypercube().xvectors[i][j]]=j;
-        for (size_t j=0; j<hypercube().xvectors[i].size(); checkCancel(), ++j)
-          {
-            auto it=srcIndices.find(hypercube().xvectors[i][j]);
-            if (it!=srcIndices.end())
-              permutations[i].push_back(it->second);
-            else
-              permutations[i].push_back(numeric_limits<size_t>::max());
-          }
+        auto res=ldiv(h, o.size());
+        if (o[res.rem]==missing)
+          return nan("");
+        argIdx+=o[res.rem];
+        h=res.quot;
       }
+    return arg->atHCIndex(argIdx);
   }
 
-    double SpreadOverHC::operator[](size_t idx) const {
-      auto splitIdx=hypercube().splitIndex(index()[idx]);
-      for (size_t i=0; i<splitIdx.size(); checkCancel(), ++i)
+  void SpreadOverHC::evaluate(double* dest) const
+  {
+    if (!index().empty() || offsets.empty() || !size())
+      return ITensor::evaluate(dest);
+    unique_ptr<DenseData> argData;
+    if (arg->index().empty())
+      argData.reset(new DenseData(*arg));
+    auto& innerOffsets=offsets[0];
+    auto rowSize=innerOffsets.size();
+    parallelFor(size()/rowSize, [&](size_t begin, size_t end) {
+      for (size_t row=begin; row<end; checkCancel())
         {
-          splitIdx[i]=permutations[i][splitIdx[i]];
-          if (splitIdx[i]>=arg->hypercube().xvectors[i].size())
-            return nan("");
+          auto d=dest+row*rowSize;
+          // a label missing along axis i leaves missing the whole slab
+          // of rows sharing that label, so find the outermost such slab
+          size_t base=0, r=row, slabRows=1, missingRows=0;
+          for (size_t i=1; i<offsets.size(); ++i)
+            {
+              auto res=ldiv(r, offsets[i].size());
+              if (offsets[i][res.rem]==missing)
+                missingRows=slabRows-row%slabRows;
+              else
+                base+=offsets[i][res.rem];
+              slabRows*=offsets[i].size();
+              r=res.quot;
+            }
+          if (missingRows)
+            {
+              auto n=min(missingRows, end-row);
+              fill(d, d+n*rowSize, nan(""));
+              row+=n;
+              continue;
+            }
+          if (argData)
+            for (size_t j=0; j<rowSize; ++j)
+              d[j]=innerOffsets[j]==missing? nan(""): argData->data()[base+innerOffsets[j]];
+          else
+            for (size_t j=0; j<rowSize; ++j)
+              d[j]=innerOffsets[j]==missing? nan(""): arg->atHCIndex(base+innerOffsets[j]);
+          ++row;
         }
-      return arg->atHCIndex(arg->hypercube().linealIndex(splitIdx));
-    }
+    }, minParallelElements/rowSize+1);
+  }
 
   namespace
   {
@@ -566,20 +914,52 @@ namespace civita
       assert(i->hypercube()==hypercube());
 #endif
 
-    // create an index vector that is the union of the arguments' index vectors
+    m_index.clear();
+    sources.clear();
+    sourceStart.clear();
+    // create an index vector that is the union of the arguments'
+    // index vectors, by a k-way merge
     if (all_of(args.begin(), args.end(), [](const TensorPtr& i) {return !i->index().empty();}))
       {
-        std::set<std::size_t> tmp_index;
-        for (auto& i: args)
+        using Cursor=pair<size_t,size_t>; // (hypercube index, argument)
+        priority_queue<Cursor, vector<Cursor>, greater<Cursor>> heap;
+        vector<size_t> offsets(args.size());
+        for (size_t i=0; i<args.size(); ++i)
+          heap.emplace(args[i]->index()[0], i);
+        Index::Impl idx;
+        while (!heap.empty())
           {
-            for (auto j: i->index())
-              checkCancel(), tmp_index.insert(j);
+            checkCancel();
+            auto top=heap.top();
+            heap.pop();
+            if (idx.empty() || idx.back()!=top.first)
+              {
+                idx.push_back(top.first);
+                sourceStart.push_back(sources.size());
+              }
+            // ties are popped in argument order
+            auto& offset=offsets[top.second];
+            sources.emplace_back(top.second, offset);
+            auto& argIndex=args[top.second]->index();
+            if (++offset<argIndex.size())
+              heap.emplace(argIndex[offset], top.second);
           }
-        m_index=tmp_index;
+        sourceStart.push_back(sources.size());
+        m_index.assignVector(std::move(idx));
       }
   }
 
   double Meld::operator[](size_t idx) const {
+    if (!sourceStart.empty())
+      {
+        for (auto s=sourceStart[idx]; s<sourceStart[idx+1]; ++s)
+          {
+            auto val=(*args[sources[s].first])[sources[s].second];
+            if (isfinite(val))
+              return val;
+          }
+        return nan("");
+      }
     size_t hcIndex=m_index[idx];
     for (auto& i: args)
       {
@@ -603,37 +983,71 @@ namespace civita
 #endif
     // extend into the next dimension
     auto hc=args.front()->hypercube();
-    hc.xvectors.emplace_back(opArgs.dimension);
+    auto& xv=hc.xvectors.emplace_back(opArgs.dimension);
     for (size_t i=0; i<args.size(); ++i)
-      hc.xvectors.back().push_back(to_string(i));
+      xv.push_back(to_string(i));
     hypercube(std::move(hc));
 
+    m_index.clear();
+    elementArg.clear();
+    argStart.clear();
+    sliceSize=args.front()->hypercube().numElements();
     if (hypercube().logNumElements()<log(numeric_limits<size_t>::max())) // make sure we can fit in a size_t
       {
         size_t total=0;
         for (auto& i: args) total+=i->size();
-        size_t sliceSize=args.front()->hypercube().numElements();
         if (total<hypercube().numElements()/2)
           {
-            // create an index vector that combines the arguments' index vectors
-            std::set<std::size_t> tmp_index;
+            // the combined index is the concatenation of the
+            // arguments' index vectors, offset by slice, so is already sorted
+            Index::Impl idx;
+            idx.reserve(total);
+            elementArg.reserve(total);
             for (size_t i=0; i<args.size(); ++i)
               {
-                if (args[i]->index().empty())
-                  for (size_t j=0; j<args[i]->size(); checkCancel(), ++j)
-                    tmp_index.insert(i*sliceSize+j);
-                else
-                  for (auto j: args[i]->index())
-                    checkCancel(), tmp_index.insert(i*sliceSize+j);
+                argStart.push_back(idx.size());
+                auto& argIndex=args[i]->index();
+                for (size_t j=0; j<args[i]->size(); checkCancel(), ++j)
+                  {
+                    idx.push_back(i*sliceSize+argIndex[j]);
+                    elementArg.push_back(i);
+                  }
               }
-            m_index=std::move(tmp_index);
+            m_index.assignVector(std::move(idx));
           }
       }
   }
 
   double Merge::operator[](size_t i) const {
     if (args.empty()) return nan("");
-    auto res=lldiv(m_index[i], args[0]->hypercube().numElements());
+    if (!elementArg.empty())
+      {
+        auto arg=elementArg[i];
+        return (*args[arg])[i-argStart[arg]];
+      }
+    auto res=lldiv(i, sliceSize);
     return args[res.quot]->atHCIndex(res.rem);
   }
+
+  void Merge::evaluate(double* dest) const
+  {
+    if (!size()) return;
+    if (!index().empty() || args.empty())
+      return ITensor::evaluate(dest);
+    parallelFor(args.size(), [&](size_t begin, size_t end) {
+      for (auto i=begin; i<end; checkCancel(), ++i)
+        {
+          auto slice=dest+i*sliceSize;
+          auto& argIndex=args[i]->index();
+          if (argIndex.empty())
+            args[i]->evaluate(slice);
+          else
+            {
+              fill(slice, slice+sliceSize, nan(""));
+              for (size_t j=0; j<argIndex.size(); ++j)
+                slice[argIndex[j]]=(*args[i])[j];
+            }
+        }
+    }, minParallelElements/sliceSize+1);
+  }
 }
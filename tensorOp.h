@@ -138,6 +138,7 @@ namespace civita
     /// prevents recursively calling computeTensor from deadlocking
     mutable std::recursive_mutex computeTensorMutex;
   public:
+    ~CachedTensorOp() {releaseAllocationStats(this);}
     const Index& index() const override {return cachedResult.index();}
     std::size_t size() const override {return cachedResult.size();}
     double operator[](std::size_t i) const override;
@@ -247,21 +248,28 @@ namespace civita
     TensorPtr arg;
     // returns hypercube index of arg given hypercube index of this
     std::size_t pivotIndex(std::size_t i) const;
+    /// transpose dense argument data \a src into \a dest
+    void transpose(double* dest, const double* src) const;
   public:
     void setArgument(const TensorPtr& a,const ITensor::Args&) override;
     /// set's the pivots orientation
     /// @param axes - list of axes that are the output
     void setOrientation(const std::vector<std::string>& axes);
     double operator[](std::size_t i) const override;
+    /// when dense, performs a cache blocked transpose of the argument
+    void evaluate(double* dest) const override;
     Timestamp timestamp() const override {return arg->timestamp();}
   };
 
   class PermuteAxis: public ITensor
   {
     TensorPtr arg;
-    std::size_t m_axis;
+    std::size_t m_axis=0;
     std::vector<std::size_t> m_permutation;
     std::vector<std::size_t> permutedIndex; /// argument indices corresponding to this indices, when sparse
+    std::size_t stride=1;         ///< stride of the permuted axis
+    std::size_t argStride=1;      ///< stride of the axis above the permuted axis in the argument
+    std::vector<std::size_t> offsets; ///< argument offsets of positions along the permuted axis
   public:
     void setArgument(const TensorPtr& a,const ITensor::Args&) override;
     void setPermutation(const std::vector<std::size_t>& p)
@@ -270,6 +278,27 @@ namespace civita
     std::size_t axis() const {return m_axis;}
     const std::vector<std::size_t>& permutation() const {return m_permutation;}
     double operator[](std::size_t i) const override;
+    /// when dense, gathers contiguous runs of the argument
+    void evaluate(double* dest) const override;
+    Timestamp timestamp() const override {return arg->timestamp();}
+  };
+
+  /// corresponds to the OLAP dice operation, selecting subsets of
+  /// labels along several axes at once
+  class Dice: public ITensor
+  {
+    TensorPtr arg;
+    /// for each axis, argument hypercube offsets of the selected positions
+    std::vector<std::vector<std::size_t>> offsets;
+    std::vector<std::size_t> permutedIndex; /// argument indices corresponding to this indices, when sparse
+  public:
+    void setArgument(const TensorPtr& a,const ITensor::Args&) override;
+    /// select positions along the named axes, in the given
+    /// order. Axes not mentioned retain all positions, and
+    /// out of range positions are ignored.
+    /// @throw if an axis is not found, or a position is repeated
+    void setSelection(const std::map<std::string,std::vector<std::size_t>>& selection);
+    double operator[](std::size_t i) const override;
     Timestamp timestamp() const override {return arg->timestamp();}
   };
 
@@ -320,12 +349,18 @@ namespace civita
   class SpreadOverHC: public ITensor
   {
     TensorPtr arg;
-    std::vector<std::vector<std::size_t>> permutations;
+    /// for each axis, argument hypercube offsets of each position, or
+    /// missing if the label is not present in the argument
+    std::vector<std::vector<std::size_t>> offsets;
+    static constexpr std::size_t missing=~std::size_t(0);
   public:
     /// set the destination hypercube prior to calling this
     /// order of axes must mathc hypercube
     void setArgument(const TensorPtr& a,const ITensor::Args&) override;
     double operator[](size_t i) const override;
+    /// when dense, evaluates rows along the first axis, filling
+    /// whole slabs of rows that map to nothing in one step
+    void evaluate(double* dest) const override;
     Timestamp timestamp() const override {return arg? arg->timestamp(): Timestamp();}
   };
 
@@ -333,6 +368,10 @@ namespace civita
   class Meld: public ITensor
   {
     std::vector<TensorPtr> args;
+    /// when sparse, (argument, offset) of the argument elements at
+    /// each index position, in argument order
+    std::vector<std::pair<std::size_t,std::size_t>> sources;
+    std::vector<std::size_t> sourceStart; ///< start of each index position's sources
   public:
 
     /// all arguments must have the same hypercube
@@ -345,6 +384,10 @@ namespace civita
   class Merge: public ITensor
   {
     std::vector<TensorPtr> args;
+    std::size_t sliceSize=0; ///< number of elements of each argument's hypercube
+    /// when sparse, the argument supplying each element, and the start of each argument's elements
+    std::vector<unsigned> elementArg;
+    std::vector<std::size_t> argStart;
   public:
 
     /// all arguments must have the same hypercube
@@ -352,6 +395,8 @@ namespace civita
     void setArguments(const std::vector<TensorPtr>& a, const ITensor::Args& ) override;
     Timestamp timestamp() const override;
     double operator[](size_t i) const override;
+    /// when dense, copies whole argument slices
+    void evaluate(double* dest) const override;
   };
     
 }
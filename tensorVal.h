@@ -25,7 +25,7 @@
 #include <chrono>
 
 #ifndef CIVITA_ALLOCATOR
-#define CIVITA_ALLOCATOR std::allocator
+#define CIVITA_ALLOCATOR civita::LibCAllocator
 #endif
 
 namespace civita
@@ -158,11 +158,13 @@ namespace civita
     
     double operator[](std::size_t i) const override {return data.empty()? 0: data[i];}
     double& operator[](std::size_t i) override {updateTimestamp(); return data[i];}
+    const double* contiguousData() const override
+    {return data.size()==size()? data.data(): nullptr;}
     const TensorVal& asg(const ITensor& x) override {
       index(x.index());
       hypercube(x.hypercube());
       assert(data.size()==x.size());
-      for (std::size_t i=0; i<x.size(); ++i) data[i]=x[i];
+      x.evaluate(data.data());
       updateTimestamp();
       return *this;
     }
@@ -176,6 +176,165 @@ SUITE(TensorOps)
         
   }
 
+  TEST(sparseSlice)
+  {
+    Hypercube hc{4,3,5};
+    auto dense=make_shared<TensorVal>(hc);
+    auto sparse=make_shared<TensorVal>(hc);
+    map<size_t,double> data;
+    for (size_t i=0; i<hc.numElements(); ++i)
+      {
+        (*dense)[i]=nan("");
+        if (i%7==0 || i%5==2)
+          (*dense)[i]=data[i]=i;
+      }
+    *sparse=data;
+    for (auto& axis: hc.xvectors)
+      for (size_t pos=0; pos<axis.size(); ++pos)
+        {
+          Slice denseSlice, sparseSlice;
+          denseSlice.setArgument(dense,{axis.name,double(pos)});
+          sparseSlice.setArgument(sparse,{axis.name,double(pos)});
+          CHECK(!sparseSlice.index().empty());
+          CHECK(sparseSlice.size()<denseSlice.size());
+          CHECK(sparseSlice.hypercube()==denseSlice.hypercube());
+          for (size_t i=0; i<denseSlice.size(); ++i)
+            if (isnan(denseSlice[i]))
+              CHECK(isnan(sparseSlice.atHCIndex(i)));
+            else
+              CHECK_EQUAL(denseSlice[i], sparseSlice.atHCIndex(i));
+        }
+  }
+
+  TEST(dice)
+  {
+    Hypercube hc{4,3,5};
+    auto dense=make_shared<TensorVal>(hc);
+    auto sparse=make_shared<TensorVal>(hc);
+    map<size_t,double> data;
+    for (size_t i=0; i<hc.numElements(); ++i)
+      {
+        (*dense)[i]=nan("");
+        if (i%7==0 || i%5==2)
+          (*dense)[i]=data[i]=i;
+      }
+    *sparse=data;
+    map<string,vector<size_t>> selection{{"0",{3,0,1}},{"2",{4,2}}};
+    for (auto& arg: {dense,sparse})
+      {
+        Dice dice;
+        dice.setArgument(arg,{});
+        dice.setSelection(selection);
+        TensorPtr chain=arg;
+        for (auto& i: selection)
+          {
+            auto permute=make_shared<PermuteAxis>();
+            permute->setArgument(chain,{i.first,0});
+            permute->setPermutation(i.second);
+            chain=permute;
+          }
+        CHECK(dice.hypercube()==chain->hypercube());
+        CHECK_EQUAL(arg->index().empty(), dice.index().empty());
+        for (size_t i=0; i<dice.hypercube().numElements(); ++i)
+          if (isnan(chain->atHCIndex(i)))
+            CHECK(isnan(dice.atHCIndex(i)));
+          else
+            CHECK_EQUAL(chain->atHCIndex(i), dice.atHCIndex(i));
+      }
+    Dice dice;
+    dice.setArgument(dense,{});
+    CHECK_THROW(dice.setSelection({{"foo",{1}}}), std::exception);
+    CHECK_THROW(dice.setSelection({{"0",{1,1}}}), std::exception);
+  }
+
+  TEST(densePivot)
+  {
+    Hypercube hc{67,13,80,3};
+    auto arg=make_shared<TensorVal>(hc);
+    for (size_t i=0; i<arg->size(); ++i)
+      (*arg)[i]=i;
+    vector<vector<string>> orientations{{"0","1","2","3"},{"1","0","2","3"},{"2","3","0","1"},
+                                        {"3","2","1","0"},{"0","3"}};
+    for (auto& orientation: orientations)
+      {
+        Pivot pivot;
+        pivot.setArgument(arg,{});
+        pivot.setOrientation(orientation);
+        auto data=pivot.data();
+        CHECK_EQUAL(pivot.size(), data.size());
+        size_t mismatches=0;
+        for (size_t i=0; i<data.size(); ++i)
+          mismatches+=data[i]!=pivot[i];
+        CHECK_EQUAL(0, mismatches);
+      }
+  }
+
+  TEST(densePermuteAxis)
+  {
+    Hypercube hc{7,13,5};
+    auto arg=make_shared<TensorVal>(hc);
+    for (size_t i=0; i<arg->size(); ++i)
+      (*arg)[i]=i;
+    for (auto& axis: {"0","1","2"})
+      {
+        PermuteAxis permute;
+        permute.setArgument(arg,{axis,0});
+        permute.setPermutation({4,20,0,3,2});
+        CHECK_EQUAL(4, permute.hypercube().xvectors[stoi(axis)].size());
+        auto data=permute.data();
+        CHECK_EQUAL(permute.size(), data.size());
+        for (size_t i=0; i<data.size(); ++i)
+          {
+            auto idx=permute.hypercube().splitIndex(i);
+            idx[stoi(axis)]=vector<size_t>{4,0,3,2}[idx[stoi(axis)]];
+            CHECK_EQUAL(hc.linealIndex(idx), data[i]);
+            CHECK_EQUAL(hc.linealIndex(idx), permute[i]);
+          }
+      }
+  }
+
+  TEST(sparsePivot)
+  {
+    Hypercube hc{67,13,80,3};
+    auto dense=make_shared<TensorVal>(hc);
+    auto sparse=make_shared<TensorVal>(hc);
+    map<size_t,double> data;
+    for (size_t i=0; i<hc.numElements(); ++i)
+      {
+        (*dense)[i]=nan("");
+        if (i%3)
+          (*dense)[i]=data[i]=i;
+      }
+    *sparse=data;
+    
+    Pivot densePivot, sparsePivot;
+    densePivot.setArgument(dense,{});
+    densePivot.setOrientation({"2","3","0","1"});
+    sparsePivot.setArgument(sparse,{});
+    sparsePivot.setOrientation({"2","3","0","1"});
+    
+    PermuteAxis densePermute, sparsePermute;
+    densePermute.setArgument(dense,{"1",0});
+    densePermute.setPermutation({12,3,0,7,5});
+    sparsePermute.setArgument(sparse,{"1",0});
+    sparsePermute.setPermutation({12,3,0,7,5});
+
+    vector<pair<const ITensor*,const ITensor*>> ops{{&densePivot,&sparsePivot},{&densePermute,&sparsePermute}};
+    for (auto& op: ops)
+      {
+        auto& index=op.second->index();
+        CHECK(!index.empty());
+        CHECK(is_sorted(index.begin(), index.end()));
+        size_t mismatches=0;
+        for (size_t i=0; i<op.first->size(); ++i)
+          {
+            auto x=op.first->atHCIndex(i), y=op.second->atHCIndex(i);
+            mismatches+=!(x==y || (isnan(x) && isnan(y)));
+          }
+        CHECK_EQUAL(0, mismatches);
+      }
+  }
+
   TEST(dimLabels)
   {
     vector<XVector> x{{"x",{Dimension::string,""}}, {"y",{Dimension::string,""}},
@@ -186,6 +345,173 @@ SUITE(TensorOps)
     CHECK_ARRAY_EQUAL(expected, hc.dimLabels(), expected.size());
   }
 
+  TEST(sharedHypercube)
+  {
+    Hypercube hc({3,4});
+    auto copy=hc;
+    CHECK(copy.xvectors.shared(0,hc.xvectors,0) && copy.xvectors.shared(1,hc.xvectors,1));
+    CHECK(copy==hc);
+    // reading axes of a non-const hypercube leaves them shared
+    for (auto& xv: copy.xvectors) CHECK(!xv.empty());
+    CHECK(copy.xvectors.shared(0,hc.xvectors,0) && copy.xvectors.shared(1,hc.xvectors,1));
+    // modifying an axis only detaches that axis
+    copy.xvectors.mutableAxis(1).name="y";
+    CHECK_EQUAL("1", hc.xvectors[1].name);
+    CHECK(copy.xvectors.shared(0,hc.xvectors,0) && !copy.xvectors.shared(1,hc.xvectors,1));
+    copy.xvectors.mutableAxis(0).push_back(3.0);
+    CHECK_EQUAL(3, hc.xvectors[0].size());
+    CHECK_EQUAL(4, copy.xvectors[0].size());
+
+    // ops share their argument's axes
+    auto arg=make_shared<TensorVal>(hc);
+    Pivot pivot;
+    pivot.setArgument(arg,{});
+    pivot.setOrientation({"1","0"});
+    CHECK(pivot.hypercube().xvectors.shared(0,hc.xvectors,1));
+    CHECK(pivot.hypercube().xvectors.shared(1,hc.xvectors,0));
+    Slice slice;
+    slice.setArgument(arg,{"0",1});
+    CHECK_EQUAL(1, slice.rank());
+    CHECK(slice.hypercube().xvectors.shared(0,hc.xvectors,1));
+    // only the permuted or diced axis is replaced
+    PermuteAxis permute;
+    permute.setArgument(arg,{"0",0});
+    permute.setPermutation({2,0});
+    CHECK_EQUAL(2, permute.hypercube().xvectors[0].size());
+    CHECK(!permute.hypercube().xvectors.shared(0,arg->hypercube().xvectors,0));
+    CHECK(permute.hypercube().xvectors.shared(1,arg->hypercube().xvectors,1));
+    Dice dice;
+    dice.setArgument(arg,{});
+    dice.setSelection({{"1",{1,3}}});
+    CHECK_EQUAL(2, dice.hypercube().xvectors[1].size());
+    CHECK(dice.hypercube().xvectors.shared(0,arg->hypercube().xvectors,0));
+    CHECK(!dice.hypercube().xvectors.shared(1,arg->hypercube().xvectors,1));
+  }
+
+  TEST(hypercubeHash)
+  {
+    Hypercube hc1({3,4}), hc2({3,4}), hc3({3,5});
+    CHECK(hc1==hc2);
+    CHECK_EQUAL(hc1.hash(), hc2.hash());
+    CHECK_EQUAL(hc1.xvectors.labelHash(1), hc2.xvectors.labelHash(1));
+    CHECK(hc1!=hc3);
+    CHECK(hc1.xvectors.labelHash(1)!=hc3.xvectors.labelHash(1));
+    // modification invalidates the cached hash
+    hc2.xvectors.mutableAxis(1).set(3,10.0);
+    CHECK(hc1!=hc2);
+    CHECK(hc1.hash()!=hc2.hash());
+    hc2.xvectors.mutableAxis(1).set(3,3.0);
+    CHECK(hc1==hc2);
+    // like equality, the hash ignores names and dimensions
+    hc2.xvectors.mutableAxis(0).name="x";
+    hc2.xvectors.mutableAxis(0).dimension.units="m";
+    CHECK(hc1==hc2);
+    CHECK_EQUAL(hc1.hash(), hc2.hash());
+    // range axis hashes are cached, and match materialised ones
+    Hypercube range({3,4});
+    CHECK_EQUAL(range.xvectors.labelHash(1), range.xvectors.labelHash(1));
+    CHECK_EQUAL(range.xvectors.labelHash(1), range.xvectors[1].labelHash());
+    CHECK_EQUAL(hc1.hash(), std::hash<Hypercube>()(hc1));
+    // modifications through a retained reference are detected
+    auto& axis=hc2.xvectors.mutableAxis(1);
+    auto h=hc2.xvectors.labelHash(1);
+    CHECK_EQUAL(h, axis.labelHash());
+    static_cast<vector<any>&>(axis).push_back(any(4.0));
+    CHECK(hc2.xvectors.labelHash(1)!=h);
+    CHECK(hc2.xvectors[1]!=hc1.xvectors[1]);
+    axis.pop_back();
+    CHECK_EQUAL(h, hc2.xvectors.labelHash(1));
+  }
+
+  TEST(unionHypercube)
+  {
+    Hypercube result(vector<XVector>{
+        XVector("s",{Dimension::string,""},{"c","a","b"}),
+        XVector("v",{Dimension::value,""},vector<any>{3.0,1.0,2.0,5.0})});
+    Hypercube x(vector<XVector>{
+        XVector("v",{Dimension::value,""},vector<any>{4.0,2.0,2.5}),
+        XVector("s",{Dimension::string,""},{"b","d","a"}),
+        XVector("e",{Dimension::string,""},{"z"})});
+    auto u=result;
+    unionHypercube(u,x,false);
+    CHECK_EQUAL(3, u.rank());
+    CHECK(u.xvectors.shared(2,x.xvectors,2));
+    CHECK_ARRAY_EQUAL((vector<any>{"a","b"}), u.xvectors[0], 2);
+    CHECK_EQUAL(6, u.xvectors[1].size());
+    CHECK_ARRAY_EQUAL((vector<any>{1.0,2.0,2.5,3.0,4.0,5.0}), u.xvectors[1], 6);
+
+    unionHypercube(result,x,true);
+    CHECK_EQUAL(3, result.rank());
+    CHECK_EQUAL(4, result.xvectors[1].size());
+    CHECK_ARRAY_EQUAL((vector<any>{2.0,2.5,3.0,4.0}), result.xvectors[1], 4);
+
+    // unchanged axes remain shared
+    auto y=x;
+    unionHypercube(y,x,true);
+    CHECK(y.xvectors.shared(2,x.xvectors,2));
+
+    // disjoint ranges
+    Hypercube empty(vector<XVector>{XVector("v",{Dimension::value,""})});
+    unionHypercube(empty,x,true);
+    CHECK_EQUAL(0, empty.rank());
+
+    // large axes, merged in parallel
+    XVector a("a",{Dimension::value,""}), b("a",{Dimension::value,""});
+    for (int i=0; i<100000; ++i)
+      {
+        a.emplace_back(2.0*i);
+        b.emplace_back(3.0*i);
+      }
+    Hypercube big(vector<XVector>{a,b});
+    big.xvectors.mutableAxis(1).name="b";
+    Hypercube other(vector<XVector>{b,a});
+    other.xvectors.mutableAxis(1).name="b";
+    unionHypercube(big, other, false);
+    CHECK_EQUAL(2, big.rank());
+    CHECK_EQUAL(166666, big.xvectors[0].size());
+    CHECK_EQUAL(166666, big.xvectors[1].size());
+    CHECK(is_sorted(big.xvectors[0].begin(), big.xvectors[0].end()));
+  }
+
+  TEST(indexAxes)
+  {
+    Hypercube hc1({3,4}), hc2(vector<unsigned>{3,4});
+    CHECK(hc1.xvectors.isRange(0) && hc1.xvectors.isRange(1));
+    CHECK(hc1==hc2);
+    CHECK_EQUAL(hc1.hash(), hc2.hash());
+    CHECK_EQUAL(12, hc1.numElements());
+    CHECK_EQUAL(2, hc1.xvectors.position(1, any(2.0)));
+    CHECK_EQUAL(4, hc1.xvectors.position(1, any(2.5)));
+    CHECK_EQUAL(4, hc1.xvectors.position(1, any(7.0)));
+    CHECK_EQUAL(4, hc1.xvectors.position(1, any("2")));
+    // const access materialises the labels
+    auto& axes=std::as_const(hc1.xvectors);
+    CHECK_EQUAL("1", axes[1].name);
+    CHECK(axes[1].dimension.type==Dimension::value);
+    CHECK_EQUAL(3, axes[1][3].asValue());
+    CHECK(hc1.xvectors.isRange(1));
+    CHECK_EQUAL(hc2.hash(), hc1.hash());
+    // a range axis equals an explicit axis with the same labels
+    Hypercube hc3(vector<XVector>{XVector("0",Dimension(Dimension::value,""),vector<any>{0.0,1.0,2.0}), axes[1]});
+    CHECK(hc3==hc2 && hc2==hc3);
+    CHECK_EQUAL(hc2.hash(), hc3.hash());
+    // modifying one hypercube's axis leaves the other unchanged
+    hc1.xvectors.mutableAxis(0).push_back(3.0);
+    CHECK(!hc1.xvectors.isRange(0));
+    CHECK_EQUAL(4, hc1.xvectors.axisSize(0));
+    CHECK_EQUAL(3, hc2.xvectors[0].size());
+    CHECK(hc1!=hc2);
+    CHECK_EQUAL(3, Hypercube({3}).xvectors[0].size());
+    // large range axes need not be materialised to be used
+    Hypercube big({1u<<30,1u<<30});
+    CHECK_EQUAL(size_t(1)<<60, big.numElements());
+    CHECK(big==Hypercube({1u<<30,1u<<30}));
+    CHECK(big!=Hypercube({1u<<30,1u<<29}));
+    vector<size_t> split{5,7};
+    CHECK_EQUAL(5+(size_t(7)<<30), big.linealIndex(split));
+    CHECK_ARRAY_EQUAL(split, big.splitIndex(big.linealIndex(split)), 2);
+  }
+
 //  struct OuterFixture: public MinskyFixture
 //  {
 //    VariablePtr x{VariableType::parameter,"x"};
@@ -313,6 +639,17 @@ SUITE(TensorOps)
       CHECK_EQUAL(2,op.atHCIndex(6));
       CHECK_EQUAL(2,op.atHCIndex(1));
 
+      // overlapping indices, falling back to later arguments for missing values
+      x.index(set<size_t>{1,7,8});
+      x[0]=nan(""); x[1]=1; x[2]=3;
+      op.setArguments({xp,yp},{"",0});
+      CHECK_EQUAL(4,op.index().size());
+      CHECK_EQUAL(2,op.atHCIndex(1));
+      CHECK_EQUAL(2,op.atHCIndex(6));
+      CHECK_EQUAL(3,op.atHCIndex(8));
+      x[0]=5;
+      CHECK_EQUAL(5,op.atHCIndex(1));
+
       auto maxTimestamp=std::max(x.timestamp(),y.timestamp());
       CHECK_EQUAL(maxTimestamp, op.timestamp());
       
@@ -356,7 +693,29 @@ SUITE(TensorOps)
 
       auto maxTimestamp=std::max(x.timestamp(),y.timestamp());
       CHECK_EQUAL(maxTimestamp, op.timestamp());
-      
+
+      // dense result, with a sparse argument
+      auto zp=make_shared<TensorVal>(hc);
+      for (unsigned i=0; i<zp->size(); ++i)
+        (*zp)[i]=3;
+      op.setArguments({zp,yp},{});
+      CHECK_EQUAL(0,op.index().size());
+      auto data=op.data();
+      CHECK_EQUAL(30,data.size());
+      for (int i=0; i<15; ++i)
+        {
+          CHECK_EQUAL(3,data[i]);
+          if (i==1 || i==6)
+            CHECK_EQUAL(2,data[i+15]);
+          else
+            CHECK(isnan(data[i+15]));
+        }
+
+      // zero length axis
+      TensorPtr ep(make_shared<TensorVal>(Hypercube{3,0}));
+      op.setArguments({ep,ep},{});
+      CHECK_EQUAL(0,op.size());
+      CHECK(op.data().empty());
     }
 
    
@@ -368,9 +727,9 @@ SUITE(TensorOps)
       auto hc1=hc;
       for (double i=0; i<5; i+=1)
         {
-          hc.xvectors.back().emplace_back(i);
+          hc.xvectors.mutableAxis(1).emplace_back(i);
           if (i>0 && i<4)
-            hc1.xvectors.back().emplace_back(i);
+            hc1.xvectors.mutableAxis(1).emplace_back(i);
         }
       TensorPtr xp(make_shared<TensorVal>(hc1));
       TensorVal& x=dynamic_cast<TensorVal&>(*xp);
@@ -388,6 +747,52 @@ SUITE(TensorOps)
           for (int j=1; j<4; ++j)
             CHECK_EQUAL(i+3*(j-1),op[i+3*j]);
         }
+      auto data=op.data();
+      CHECK_EQUAL(op.size(), data.size());
+      for (size_t i=0; i<data.size(); ++i)
+        if (isnan(op[i]))
+          CHECK(isnan(data[i]));
+        else
+          CHECK_EQUAL(op[i], data[i]);
+
+      // spread along both axes, with missing labels on the inner axis
+      auto& axis0=hc.xvectors.mutableAxis(0);
+      axis0.erase(axis0.begin()+1);
+      axis0.emplace_back(7.0);
+      op.hypercube(hc);
+      op.setArgument(xp,{});
+      data=op.data();
+      CHECK_EQUAL(op.size(), data.size());
+      for (size_t i=0; i<data.size(); ++i)
+        if (isnan(op[i]))
+          CHECK(isnan(data[i]));
+        else
+          CHECK_EQUAL(op[i], data[i]);
+      CHECK_EQUAL(3, op[3*2]);
+      CHECK_EQUAL(5, op[3*2+1]);
+      CHECK(isnan(op[3*2+2]));
+
+      // missing labels along outer axes leave whole slabs missing
+      Hypercube argHC(vector<XVector>{
+          XVector("a",Dimension(Dimension::value,""),vector<any>{0.0,1.0}),
+          XVector("b",Dimension(Dimension::value,""),vector<any>{0.0,1.0}),
+          XVector("c",Dimension(Dimension::value,""),vector<any>{0.0,1.0})});
+      Hypercube spreadHC(vector<XVector>{
+          XVector("a",Dimension(Dimension::value,""),vector<any>{0.0,1.0}),
+          XVector("b",Dimension(Dimension::value,""),vector<any>{0.0,5.0,1.0}),
+          XVector("c",Dimension(Dimension::value,""),vector<any>{9.0,0.0,1.0})});
+      auto arg3=make_shared<TensorVal>(argHC);
+      for (size_t i=0; i<arg3->size(); ++i) (*arg3)[i]=i;
+      op.hypercube(spreadHC);
+      op.setArgument(arg3,{});
+      data=op.data();
+      CHECK_EQUAL(18, data.size());
+      for (size_t i=0; i<data.size(); ++i)
+        if (i<6 || i%6/2==1)
+          CHECK(isnan(data[i]));
+        else
+          CHECK_EQUAL(op[i], data[i]);
+      CHECK_EQUAL(7, data[17]);
     }
 
    TEST(DenseSpreadFirst)
@@ -425,6 +830,12 @@ SUITE(TensorOps)
        vector<double> expected{0,0,0,3,3,3,4,4,4};
        CHECK_EQUAL(expected.size(), op.size());
        CHECK_ARRAY_EQUAL(expected, op, op.size());
+
+       // spreading over a zero length axis yields an empty tensor
+       op.setSpreadDimensions(Hypercube{2,0});
+       op.setIndex();
+       CHECK_EQUAL(0, op.hypercube().numElements());
+       CHECK(op.index().empty());
      }
 
      TEST(DenseSpreadLast)
@@ -466,6 +877,144 @@ SUITE(TensorOps)
 
     // TODO - adapt binInterpolation* tests from Minsky to tests here
     
+    TEST(InterpolateHC2DRotated)
+     {
+       Dimension value(Dimension::value,"");
+       Hypercube argHC(vector<XVector>{XVector("x",value,vector<any>{0.0,1.0,2.0,4.0}),
+                         XVector("y",value,vector<any>{0.0,10.0,20.0})});
+       auto arg=make_shared<TensorVal>(argHC);
+       for (size_t i=0; i<4; ++i)
+         for (size_t j=0; j<3; ++j)
+           (*arg)[i+4*j]=2*argHC.xvectors[0][i].asValue()+3*argHC.xvectors[1][j].asValue();
+
+       // target axes are rotated, unsorted, and extend beyond the argument's
+       vector<double> x{3,0.5,5}, y{25,5,15};
+       Hypercube hc(vector<XVector>{XVector("y",value,vector<any>(y.begin(),y.end())),
+                      XVector("x",value,vector<any>(x.begin(),x.end()))});
+       InterpolateHC op;
+       op.hypercube(hc);
+       op.setArgument(arg,{});
+       CHECK_EQUAL(9, op.size());
+       for (size_t i=0; i<3; ++i)
+         for (size_t j=0; j<3; ++j)
+           CHECK_CLOSE(2*min(x[j],4.0)+3*min(y[i],20.0), op[i+3*j], 1e-10);
+     }
+
+    TEST(InterpolateHCSparse)
+     {
+       Dimension value(Dimension::value,"");
+       Hypercube argHC(vector<XVector>{XVector("x",value,vector<any>{0.0,1.0,2.0,3.0}),
+                                       XVector("y",value,vector<any>{0.0,1.0})});
+       auto arg=make_shared<TensorVal>(argHC);
+       (*arg)=map<size_t,double>{{0,1},{1,2},{3,4},{4,10},{5,20},{7,40}};
+       Hypercube hc(vector<XVector>{XVector("x",value,vector<any>{0.5,1.5,2.5,3.0}),
+                                    XVector("y",value,vector<any>{0.0,0.5})});
+       InterpolateHC op;
+       op.hypercube(hc);
+       op.setArgument(arg,{});
+       CHECK_EQUAL(0, op.index().size());
+       double nan=std::nan("");
+       vector<double> expected{1.5,nan,nan,4,8.25,nan,nan,22};
+       auto data=op.data();
+       CHECK_EQUAL(expected.size(), data.size());
+       for (size_t i=0; i<expected.size(); ++i)
+         if (isfinite(expected[i]))
+           {
+             CHECK_CLOSE(expected[i], op[i], 1e-10);
+             CHECK_CLOSE(expected[i], data[i], 1e-10);
+           }
+         else
+           {
+             CHECK(isnan(op[i]));
+             CHECK(isnan(data[i]));
+           }
+     }
+
+    TEST(InterpolateHCLargeSparse)
+     {
+       // large enough for weights to be computed in parallel
+       const size_t n=150000;
+       Dimension value(Dimension::value,"");
+       XVector x("x",value), y("x",value);
+       map<size_t,double> data;
+       for (size_t i=0; i<n; ++i)
+         {
+           x.emplace_back(double(i));
+           y.emplace_back(i+0.5);
+           if (i%10) data[i]=i;
+         }
+       auto arg=make_shared<TensorVal>(Hypercube(vector<XVector>{x}));
+       *arg=data;
+       InterpolateHC op;
+       op.hypercube(Hypercube(vector<XVector>{y}));
+       op.setArgument(arg,{});
+       auto values=op.data();
+       size_t mismatches=0;
+       for (size_t i=0; i<n; ++i)
+         if (i==n-1) // extrapolated
+           mismatches+=values[i]!=i;
+         else if (i%10==0 || i%10==9)
+           mismatches+=!isnan(values[i]);
+         else
+           mismatches+=values[i]!=i+0.5;
+       CHECK_EQUAL(0, mismatches);
+     }
+
+    TEST(PivotedInterpolateHC)
+     {
+       Dimension value(Dimension::value,""), text(Dimension::string,"");
+       Hypercube argHC(vector<XVector>{XVector("country",text,{"a","b","c"}),
+                                       XVector("year",value,vector<any>{0.0,10.0})});
+       auto arg=make_shared<TensorVal>(argHC);
+       for (size_t i=0; i<arg->size(); ++i) (*arg)[i]=i;
+       Hypercube hc(vector<XVector>{XVector("year",value,vector<any>{5.0,10.0}),
+                                    XVector("country",text,{"c","d","a"})});
+       PivotedInterpolateHC op;
+       op.hypercube(hc);
+       op.setArgument(arg,{});
+       // label d is dropped
+       CHECK_EQUAL(2, op.hypercube().xvectors[1].size());
+       CHECK_EQUAL(0, op.index().size());
+       vector<double> expected{3.5,5,1.5,3};
+       CHECK_EQUAL(expected.size(), op.size());
+       for (size_t i=0; i<expected.size(); ++i)
+         CHECK_CLOSE(expected[i], op[i], 1e-10);
+
+       // still a Pivot, so can be reoriented
+       op.setOrientation({"country","year"});
+       CHECK_EQUAL("country", op.hypercube().xvectors[0].name);
+       CHECK_CLOSE(1.5, op[1], 1e-10);
+       CHECK_CLOSE(5, op[2], 1e-10);
+
+       // interpolated results of sparse arguments are dense
+       (*arg)=map<size_t,double>{{0,0},{3,3},{5,5}};
+       op.hypercube(hc);
+       op.setArgument(arg,{});
+       CHECK_EQUAL(0, op.index().size());
+       CHECK_CLOSE(5, op.atHCIndex(1), 1e-10);
+       CHECK_CLOSE(1.5, op.atHCIndex(2), 1e-10);
+       CHECK_CLOSE(3, op.atHCIndex(3), 1e-10);
+       CHECK(isnan(op.atHCIndex(0)));
+
+       // but sparse if nothing is interpolated
+       op.hypercube(Hypercube(vector<XVector>{XVector("year",value,vector<any>{0.0,10.0}),
+                                              XVector("country",text,{"c","a"})}));
+       op.setArgument(arg,{});
+       CHECK_EQUAL(3, op.index().size());
+       CHECK_CLOSE(5, op.atHCIndex(1), 1e-10);
+       CHECK_CLOSE(3, op.atHCIndex(3), 1e-10);
+
+       // no matching labels
+       op.hypercube(Hypercube(vector<XVector>{XVector("year",value,vector<any>{5.0}),
+                                              XVector("country",text,{"d"})}));
+       op.setArgument(arg,{});
+       CHECK(isnan(op[0]));
+
+       // target axis missing from the argument
+       op.hypercube(Hypercube(vector<XVector>{XVector("month",value,vector<any>{5.0})}));
+       CHECK_THROW(op.setArgument(arg,{}), std::runtime_error);
+     }
+
     // tests that InterpolatHC trims correctly - for Ravel #545.
     TEST(InterpolateHC2DTrimming1DSparse)
      {
@@ -473,7 +1022,8 @@ SUITE(TensorOps)
        auto arg=make_shared<TensorVal>(vector<unsigned>{5,3});
        (*arg)=map<size_t,double>{{0,0},{3,3},{4,4},{7,7},{9,9},{10,10},{13,13}};
        auto hc=arg->hypercube();
-       hc.xvectors[0].erase(hc.xvectors[0].begin()); // remove first element of first dimension (trimmed)
+       auto& axis0=hc.xvectors.mutableAxis(0);
+       axis0.erase(axis0.begin()); // remove first element of first dimension (trimmed)
        op.hypercube(hc);
        op.setArgument(arg,{});
        CHECK_EQUAL(0, op.index().size());
@@ -18,6 +18,7 @@
 */
 
 #include "tensorVal.h"
+#include "parallel.h"
 using namespace civita;
 
 #include <UnitTest++/UnitTest++.h>
@@ -42,5 +43,157 @@ SUITE(TensorVal)
       if (!denseData.count(i))
         CHECK(isnan((*this)[i]));
   }
+
+  TEST(sharedIndex)
+  {
+    Hypercube hc{3,3};
+    TensorVal x;
+    x.assign(hc,map<size_t,double>{{1,1},{3,3},{8,8}});
+    TensorVal y(x);
+    CHECK(y.index().shared(x.index()));
+    CHECK(y.index()==x.index());
+    CHECK_EQUAL(2, y.index().linealOffset(8));
+    x.assign(hc,map<size_t,double>{{1,1},{4,4}});
+    CHECK(!y.index().shared(x.index()));
+    CHECK(y.index()!=x.index());
+    CHECK_EQUAL(3, y.size());
+    CHECK_EQUAL(8, y.index()[2]);
+    Index empty;
+    CHECK(empty.empty() && !empty.shared(Index()));
+    CHECK_EQUAL(0, empty.linealOffset(1));
+  }
+    
+
+  TEST(memoryAccounting)
+  {
+    vector<double,LibCAllocator<double>> x;
+    size_t base=allocatedMemory();
+    vector<pair<size_t,bool>> crossings;
+    memoryThresholds({base+1000*sizeof(double)},
+                     [&](size_t threshold, size_t, bool exceeded)
+                     {crossings.emplace_back(threshold,exceeded);});
+    clearAllocationStats();
+    {
+      MemoryAttribution attribution("test",&x);
+      x.resize(2000);
+    }
+    CHECK(allocatedMemory()>=base+2000*sizeof(double));
+    CHECK(peakMemory()>=allocatedMemory());
+    auto stats=allocationStatsByCategory()["test"];
+    CHECK_EQUAL(1,stats.allocations);
+    CHECK_EQUAL(2000*sizeof(double),stats.bytesAllocated);
+    CHECK_EQUAL(2000*sizeof(double),allocationStatsByTensor()[&x].bytesAllocated);
+    x.clear(); x.shrink_to_fit();
+    CHECK_EQUAL(base,allocatedMemory());
+    CHECK_EQUAL(2,crossings.size());
+    CHECK(crossings[0].second);
+    CHECK(!crossings[1].second);
+    memoryThresholds({},{});
+
+    auto budget=memoryBudget();
+    memoryBudget(allocatedMemory()+100);
+    CHECK_THROW(x.resize(1000), std::bad_alloc);
+    memoryBudget(budget);
+
+    // indices are tracked too
+    base=allocatedMemory();
+    {
+      Index idx(set<size_t>{1,2,3});
+      CHECK(allocatedMemory()>=base+3*sizeof(size_t));
+    }
+    CHECK_EQUAL(base,allocatedMemory());
+  }
+
+  TEST(parallelMemoryAttribution)
+  {
+    clearAllocationStats();
+    size_t n=2*numThreads();
+    {
+      MemoryAttribution attribution("parallel");
+      parallelFor(n, [](size_t begin, size_t end) {
+        for (auto i=begin; i<end; ++i)
+          vector<double,LibCAllocator<double>>(100);
+      });
+    }
+    CHECK_EQUAL(n, allocationStatsByCategory()["parallel"].allocations);
     
+    clearAllocationStats();
+    {
+      MemoryAttribution attribution(typeid(TensorVal));
+      vector<double,LibCAllocator<double>>(100);
+    }
+    CHECK_EQUAL(1, allocationStatsByCategory()["civita::TensorVal"].allocations);
+  }
+
+  TEST(memoryAttributionOwnership)
+  {
+    clearAllocationStats();
+    vector<double,LibCAllocator<double>> x, y;
+    {
+      MemoryAttribution attribution("owner",&x);
+      x.resize(1000);
+      y.resize(500);
+    }
+    {
+      // frees are credited to the allocating scope, not this one
+      MemoryAttribution attribution("other");
+      x.clear(); x.shrink_to_fit();
+    }
+    auto owner=allocationStatsByCategory()["owner"];
+    CHECK_EQUAL(1000*sizeof(double),owner.bytesFreed);
+    CHECK_EQUAL(1500*sizeof(double),owner.peak);
+    CHECK_EQUAL(0,allocationStatsByCategory()["other"].bytesFreed);
+    CHECK_EQUAL(1000*sizeof(double),allocationStatsByTensor()[&x].bytesFreed);
+
+    releaseAllocationStats(&x);
+    CHECK(!allocationStatsByTensor().count(&x));
+    // outstanding allocations may still be freed once released
+    y.clear(); y.shrink_to_fit();
+    CHECK_EQUAL(1500*sizeof(double),allocationStatsByCategory()["owner"].bytesFreed);
+  }
+
+  TEST(nestedParallelFor)
+  {
+    atomic<size_t> foreignThreads{0}, count{0}, notInside{0};
+    parallelFor(2*numThreads(), [&](size_t begin, size_t end) {
+      if (!inParallelFor()) ++notInside;
+      auto outer=this_thread::get_id();
+      for (auto i=begin; i<end; ++i)
+        parallelFor(minParallelElements, [&](size_t b, size_t e) {
+          if (this_thread::get_id()!=outer) ++foreignThreads;
+          count+=e-b;
+        }, 1);
+    });
+    CHECK(!inParallelFor());
+    if (numThreads()>1) // otherwise the outer call is serial too
+      CHECK_EQUAL(0, notInside.load());
+    CHECK_EQUAL(0, foreignThreads.load());
+    CHECK_EQUAL(2*numThreads()*minParallelElements, count.load());
+  }
+
+  TEST(spillToDisk)
+  {
+    vector<double,LibCAllocator<double>> x;
+    auto budget=memoryBudget();
+    memoryBudget(allocatedMemory()+100);
+    spillToDisk(true);
+    auto base=allocatedMemory();
+    clearAllocationStats();
+    {
+      MemoryAttribution attribution("spill");
+      x.resize(100000,1);
+    }
+    CHECK_EQUAL(x.size()*sizeof(double), spilledMemory());
+    // spilled bytes are accounted and attributed like any other
+    CHECK_EQUAL(base+x.size()*sizeof(double), allocatedMemory());
+    CHECK_EQUAL(x.size()*sizeof(double), allocationStatsByCategory()["spill"].bytesAllocated);
+    for (size_t i=0; i<x.size(); ++i) x[i]=i;
+    CHECK_EQUAL(99999,x.back());
+    x.clear(); x.shrink_to_fit();
+    CHECK_EQUAL(0,spilledMemory());
+    CHECK_EQUAL(base,allocatedMemory());
+    CHECK_EQUAL(100000*sizeof(double), allocationStatsByCategory()["spill"].bytesFreed);
+    spillToDisk(false);
+    memoryBudget(budget);
+  }
 }
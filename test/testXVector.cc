@@ -23,6 +23,7 @@ using namespace civita;
 #include <UnitTest++/UnitTest++.h>
 
 #include <exception>
+#include <set>
 using namespace std;
 
 #include <boost/date_time.hpp>
@@ -53,12 +54,12 @@ SUITE(XVector)
       dimension.units="%Y-Q%Q";
       push_back("2018-Q2");
       
-      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().asTime());
       CHECK_THROW(push_back("2-2018"),std::exception);
       
       dimension.units="Q%Q-%Y";
       push_back("Q2-2018");
-      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().asTime());
       CHECK_THROW(push_back("2-2018"),std::exception);
       
       dimension.units="Q%Q";
@@ -66,23 +67,23 @@ SUITE(XVector)
 
       dimension.units="%Y-%m-%d";
       push_back("2018-04-01");
-      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().asTime());
       CHECK_THROW(push_back("2-2018"),std::exception);
 
       // test some wonky dates and times
       dimension.units="%d/%m/%Y";
       push_back("1/4/2018");
-      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().asTime());
       CHECK_THROW(push_back("2-2018"),std::exception);
 
       dimension.units="%d/%m/%Y %H:%M:%S";
       push_back("1/4/2018 12:52:13");
-      CHECK_EQUAL(ptime(date(2018,Apr,1),time_duration(12,52,13)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1),time_duration(12,52,13)), back().asTime());
       CHECK_THROW(push_back("2-2018"),std::exception);
       
       dimension.units.clear();
       push_back("2018-04-01");
-      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().time);
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), back().asTime());
       CHECK_THROW(push_back("foo"),std::exception);
 
     }
@@ -110,8 +111,8 @@ SUITE(XVector)
   TEST(compareInvalidStoredType)
   {
     XVector a("a",{Dimension::string,""},{"foo","bar","foobar"}), b=a;
-    b[0]=string("1.0"); // ensure we have mixed types
-    b[1]="2.0";
+    b.set(0,string("1.0")); // ensure we have mixed types
+    b.set(1,"2.0");
     CHECK(!(a==b));
   }
 
@@ -128,8 +129,60 @@ SUITE(XVector)
     //screwy dates
     CHECK_EQUAL("2009-09-01",str(anyVal({Dimension::time,"%m/%d/%Y"}, "9/1/2009"), "%Y-%m-%d"));
     CHECK_EQUAL("2009-09-01",str(anyVal({Dimension::time,"%Y%m%d"}, "20090901"), "%Y-%m-%d"));
-   
+  }
+
+  TEST(timeParser)
+  {
+    CHECK_EQUAL("2020-03-15",str(anyVal({Dimension::time,"%d %b %Y"}, "15 Mar 2020"), "%Y-%m-%d"));
+    CHECK_EQUAL("2020-03-15",str(anyVal({Dimension::time,"%d %b %Y"}, "15 MAR 2020"), "%Y-%m-%d"));
+    CHECK_EQUAL("2020-03-15 12:30:05",
+                str(anyVal({Dimension::time,"%Y%m%d%H%M%S"}, "20200315123005"), "%Y-%m-%d %H:%M:%S"));
+    CHECK_EQUAL("2020-03-01",str(anyVal({Dimension::time,"%b%Y"}, "Mar2020"), "%Y-%m-%d"));
+    CHECK_EQUAL("2020-03-01",str(anyVal({Dimension::time,"%%%Y%m"}, "%202003"), "%Y-%m-%d"));
+    CHECK_THROW(anyVal({Dimension::time,"%Y%m%d"}, "20090931"), std::exception);
+    CHECK_THROW(anyVal({Dimension::time,"%d %b %Y"}, "15 Foo 2020"), std::exception);
+    // quarters, ignoring surrounding whitespace
+    CHECK_EQUAL("2002-04-01",str(anyVal({Dimension::time," %Y-Q%Q "}, "2002-Q2"), "%Y-%m-%d"));
+    CHECK_EQUAL("2002-10-01",str(anyVal({Dimension::time,"Q%Q %Y"}, "  Q4 2002 "), "%Y-%m-%d"));
+    CHECK_THROW(anyVal({Dimension::time,"%Y-Q%Q"}, "02-Q2"), std::exception);
+    // text that doesn't match literally is matched as a regular expression
+    CHECK_EQUAL("2002-04-01",str(anyVal({Dimension::time,"%Y[ -]Q%Q"}, "2002 Q2"), "%Y-%m-%d"));
+    CHECK_EQUAL("2002-07-01",str(anyVal({Dimension::time,"Q%Q.%Y"}, "Q3/2002"), "%Y-%m-%d"));
+    CHECK_THROW(anyVal({Dimension::time,"%Y[ -]Q%Q"}, "2002_Q2"), std::exception);
+    CHECK_THROW(anyVal({Dimension::time,"%Y-Q%Q"}, "2002-Q2x"), std::exception);
+    CHECK_THROW(anyVal({Dimension::time,"%Y-Q%Q"}, "2002-Q5"), std::exception);
+    CHECK_EQUAL("2002-07-01",str(anyVal({Dimension::time,"%Y%Q"}, "20023"), "%Y-%m-%d"));
+    CHECK_EQUAL("2002-04-01",str(anyVal({Dimension::time,"%y Q%Q"}, "02 Q2"), "%Y-%m-%d"));
+    CHECK_THROW(anyVal({Dimension::time,"%y Q%Q"}, "02 Q5"), std::exception);
+    // 2 digit years, pivoting at 69
+    CHECK_EQUAL("2024-03-15",str(anyVal({Dimension::time,"%d-%b-%y"}, "15-Mar-24"), "%Y-%m-%d"));
+    CHECK_EQUAL("1969-03-15",str(anyVal({Dimension::time,"%d-%b-%y"}, "15-Mar-69"), "%Y-%m-%d"));
+    CHECK_EQUAL("2068-03-15",str(anyVal({Dimension::time,"%y%m%d"}, "680315"), "%Y-%m-%d"));
 
+    // direct use of the parser, including mismatches and invalid formats
+    TimeParser parser;
+    ptime t;
+    parser.compile("%y%m%d");
+    CHECK(parser.valid());
+    CHECK(parser("991231",t));
+    CHECK_EQUAL(ptime(date(1999,Dec,31)), t);
+    CHECK(!parser("9912310",t)); // trailing data
+    CHECK(!parser("9a1231",t));
+    CHECK(!parser("991331",t)); // invalid month
+    parser.compile("%Y Q%Q");
+    CHECK(parser("2020 Q4",t));
+    CHECK_EQUAL(ptime(date(2020,Oct,1)), t);
+    CHECK(!parser("2020 Q0",t));
+    CHECK(!parser("2020 Q5",t));
+    CHECK(!parser("2020 q4",t));
+    parser.compile("%Y%");
+    CHECK(!parser.valid());
+    parser.compile("%Y %Z");
+    CHECK(!parser.valid());
+    parser.compile("%Y%%");
+    CHECK(parser.valid());
+    CHECK(parser("2020%",t));
+    CHECK_EQUAL(ptime(date(2020,Jan,1)), t);
   }
 
   TEST(incompatibleDiff)
@@ -182,6 +235,124 @@ SUITE(XVector)
       CHECK(aprilFool<dayLater);
       CHECK(aprilFool==aprilFool);
       CHECK_EQUAL(86400, diff(dayLater, aprilFool));
+
+      // checked accessors do not expose the overlaid storage
+      CHECK_EQUAL(ptime(date(2018,Apr,1)), aprilFool.asTime());
+      CHECK_EQUAL(0, aprilFool.asValue());
+      CHECK_EQUAL(1, one.asValue());
+      CHECK(one.asTime().is_not_a_date_time());
+      CHECK(any().asTime().is_not_a_date_time());
+      CHECK_EQUAL(0, hello.asValue());
+    }
+
+  TEST(position)
+    {
+      XVector x("x",{Dimension::string,""},{"foo","bar","foobar"});
+      CHECK_EQUAL(1, x.position(any("bar")));
+      CHECK_EQUAL(3, x.position(any("baz")));
+      CHECK_EQUAL(3, x.position(any(1.0)));
+      // modifications are reflected in subsequent lookups
+      x.push_back("baz");
+      CHECK_EQUAL(3, x.position(any("baz")));
+      x.set(0,string("qux"));
+      CHECK_EQUAL(4, x.position(any("foo")));
+      CHECK_EQUAL(0, x.position(any("qux")));
+      x.erase(x.begin());
+      CHECK_EQUAL(0, x.position(any("bar")));
+      auto y=x;
+      y.emplace_back(1.0);
+      CHECK_EQUAL(3, y.position(any(1.0)));
+      CHECK_EQUAL(3, x.position(any(1.0)));
+      x=y;
+      CHECK_EQUAL(3, x.position(any(1.0)));
+      
+      XVector v("v",{Dimension::value,""});
+      for (int i=0; i<1000; ++i) v.emplace_back(2*i);
+      size_t mismatches=0;
+      for (int i=0; i<2000; ++i)
+        mismatches+=v.position(any(i))!=(i%2? v.size(): i/2);
+      CHECK_EQUAL(0, mismatches);
+    }
+
+  TEST(positionTimeAxis)
+    {
+      XVector t("t",{Dimension::time,""});
+      ptime start(date(2000,1,1));
+      const int n=50000;
+      for (int i=0; i<n; ++i) t.emplace_back(start+hours(i));
+      set<size_t> hashes;
+      for (auto& i: t) hashes.insert(i.hash());
+      CHECK_EQUAL(n, hashes.size());
+      size_t mismatches=0;
+      for (int i=0; i<n; ++i)
+        mismatches+=t.position(any(start+hours(i)))!=size_t(i);
+      CHECK_EQUAL(0, mismatches);
+      CHECK_EQUAL(n, t.position(any(start-hours(1))));
+
+      // changes made via the base vector are detected
+      static_cast<vector<any>&>(t).push_back(any(start-hours(1)));
+      CHECK_EQUAL(n, t.position(any(start-hours(1))));
+      static_cast<vector<any>&>(t).erase(static_cast<vector<any>&>(t).begin());
+      CHECK_EQUAL(0, t.position(any(start+hours(1))));
+    }
+
+  TEST(internedString)
+    {
+      any a("foo"), b(string("foo")), c("bar"), e;
+      CHECK_EQUAL(a.string.id(), b.string.id());
+      CHECK(a.string.id()!=c.string.id());
+      CHECK_EQUAL(0, e.string.id());
+      CHECK(e.empty());
+      CHECK(a==b && a.hash()==b.hash());
+      CHECK(c<a && !(a<b) && a<=b && c<=a && !(a<=c));
+      CHECK(a.string=="foo" && string("foo")==a.string && a.string!="bar");
+      CHECK_EQUAL("foo", str(a));
+      CHECK_EQUAL(3, a.string.length());
+      CHECK_EQUAL('f', a.string[0]);
+    }
+
+  TEST(internedStringInterface)
+    {
+      InternedString s("hello world"), w("world");
+      CHECK_EQUAL("world", s.substr(6));
+      CHECK_EQUAL(6, s.find("wor"));
+      CHECK_EQUAL(6, s.find(w));
+      CHECK_EQUAL(9, s.rfind('l'));
+      CHECK_EQUAL(2, s.find_first_of("lo"));
+      CHECK_EQUAL(InternedString::npos, s.find('z'));
+      CHECK(s.compare("hello")>0 && s.compare(w)<0 && s.compare(0,5,"hello")==0);
+      CHECK_EQUAL("hello world", string(s.begin(), s.end()));
+      CHECK_EQUAL("dlrow olleh", string(s.rbegin(), s.rend()));
+      CHECK_EQUAL('h', s.front());
+      CHECK_EQUAL('d', s.back());
+      CHECK_THROW(s.at(20), std::out_of_range);
+      CHECK(s<string("z") && string("a")<s && s>"a" && "z">s);
+      CHECK_EQUAL("hello world!", s+"!");
+      CHECK_EQUAL("say hello world", "say "+s);
+      CHECK_EQUAL("worldworld", w+w);
+
+      // appending interns the result, and leaves other copies unchanged
+      auto t=w;
+      t+="!";
+      CHECK_EQUAL("world!", t);
+      CHECK_EQUAL(InternedString("world!").id(), t.id());
+      CHECK_EQUAL("world", w);
+
+      // pooled strings remain valid for the process lifetime
+      vector<InternedString> many;
+      for (size_t i=0; i<10000; ++i) many.emplace_back(to_string(i));
+      CHECK_EQUAL("hello world", s);
+      CHECK_EQUAL("9999", many.back());
+      CHECK_EQUAL(InternedString("1234").id(), many[1234].id());
+
+      // ordering is by value, whether or not strings are ranked yet
+      auto sorted=many;
+      sort(sorted.begin(), sorted.end());
+      CHECK(is_sorted(sorted.begin(), sorted.end(),
+                      [](const InternedString& x, const InternedString& y) {return x.str()<y.str();}));
+      InternedString late("12345x"), early("0");
+      CHECK(early<late && late<InternedString("9") && !(late<late) && late<=late);
+      CHECK(many[1234]<late && late>many[1234]);
     }
 
   TEST(imposeDimensions)
@@ -18,7 +18,14 @@
 */
 
 #include "xvector.h"
-#include <regex>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <string_view>
+#include <unordered_map>
 
 using namespace std;
 
@@ -40,44 +47,324 @@ namespace civita
     };
   }
 
+  namespace
+  {
+    /// reads between \a minDigits and \a maxDigits decimal digits from \a p into \a v
+    bool readDigits(const char*& p, size_t minDigits, size_t maxDigits, int& v)
+    {
+      v=0;
+      size_t n=0;
+      for (; n<maxDigits && isdigit(static_cast<unsigned char>(*p)); ++n, ++p)
+        v=10*v+(*p-'0');
+      return n>=minDigits;
+    }
+
+    /// matches \a literal at \a p, advancing past it
+    bool readLiteral(const char*& p, const string& literal)
+    {
+      if (strncmp(p, literal.c_str(), literal.size())!=0)
+        return false;
+      p+=literal.size();
+      return true;
+    }
+
+    bool isSpace(char c) {return isspace(static_cast<unsigned char>(c));}
+  }
+  
   void Extractor::setPattern(const string& fmt, size_t pq)
   {
     auto pos1=fmt.find("%Y");
     if (pos1==string::npos)
       throw runtime_error("year not specified in format string");
     auto pos2=pq;
-    auto re1="(\\d{4})", re2="(\\d)";
+    width1=4; width2=1;
+    swapVars=false;
     if (pos2<pos1)
       {
         swap(pos2,pos1);
-        swap(re1,re2);
+        swap(width1,width2);
         swapVars=true;
       }
+    // surrounding whitespace is ignored
+    prefix=fmt.substr(0,pos1);
+    prefix.erase(0, find_if_not(prefix.begin(), prefix.end(), isSpace)-prefix.begin());
+    infix=fmt.substr(pos1+2,pos2-pos1-2);
+    suffix=fmt.substr(pos2+2);
+    suffix.erase(find_if_not(suffix.rbegin(), suffix.rend(), isSpace).base(), suffix.end());
+    format=fmt;
+
+    auto re1="(\\d{4})", re2="(\\d)";
+    if (swapVars) swap(re1,re2);
     rePat="\\s*"+fmt.substr(0,pos1)+re1+
       fmt.substr(pos1+2,pos2-pos1-2)+re2+
       fmt.substr(pos2+2)+"\\s*";
-    pattern=regex(rePat);
+    try
+      {
+        pattern=make_shared<const regex>(rePat);
+      }
+    catch (const regex_error&)
+      {
+        pattern.reset(); // literal matching only
+      }
   }
 
   void Extractor::operator()(const string& data, int& var1, int& var2) const
   {
+    auto p=data.c_str();
+    for (; isSpace(*p); ++p);
+    if (readLiteral(p,prefix) && readDigits(p,width1,width1,var1) &&
+        readLiteral(p,infix) && readDigits(p,width2,width2,var2) && readLiteral(p,suffix))
+      {
+        for (; isSpace(*p); ++p);
+        if (!*p)
+          {
+            if (swapVars) swap(var1,var2);
+            return;
+          }
+      }
     smatch match;
-    if (regex_match(data,match,pattern))
+    if (pattern && regex_match(data,match,*pattern))
       {
         var1=stoi(match[1]);
         var2=stoi(match[2]);
         if (swapVars) swap(var1,var2);
+        return;
       }
-    else
-      throw runtime_error("data "+data+" fails to match pattern "+rePat);
+    throw runtime_error("data "+data+" fails to match pattern "+(pattern? rePat: format));
   }
 
+  void TimeParser::compile(const string& format)
+  {
+    tokens.clear();
+    m_valid=true;
+    for (size_t i=0; i<format.size(); ++i)
+      if (format[i]=='%' && (i+1==format.size() || format[i+1]!='%'))
+        {
+          // reject unsupported specifiers, and a dangling trailing %
+          if (i+1==format.size() || !format[++i] || !strchr("YymdHMSbQ", format[i]))
+            {
+              m_valid=false;
+              return;
+            }
+          tokens.push_back({format[i], {}});
+        }
+      else
+        {
+          if (tokens.empty() || tokens.back().field)
+            tokens.push_back({0, {}});
+          tokens.back().literal+=format[i];
+          if (format[i]=='%') ++i; // %% represents a literal %
+        }
+  }
+
+  bool TimeParser::operator()(const string& data, ptime& t) const
+  {
+    static const char* months[]={"jan","feb","mar","apr","may","jun","jul","aug","sep","oct","nov","dec"};
+    int day=1, month=1, year=1400, hours=0, minutes=0, seconds=0, v;
+    auto p=data.c_str();
+    for (auto& token: tokens)
+      {
+        bool ok=true;
+        switch (token.field)
+          {
+          case 0: ok=readLiteral(p, token.literal); break;
+          case 'Y': ok=readDigits(p,1,4,year); break;
+          case 'y': // 2 digit year, with 69-99 in the 20th century
+            if ((ok=readDigits(p,2,2,v)))
+              year=v>68? v+1900: v+2000;
+            break;
+          case 'Q':
+            if ((ok=readDigits(p,1,1,v) && v>=1 && v<=4))
+              month=3*(v-1)+1;
+            break;
+          case 'm': ok=readDigits(p,1,2,month); break;
+          case 'd': ok=readDigits(p,1,2,day); break;
+          case 'H': ok=readDigits(p,1,2,hours); break;
+          case 'M': ok=readDigits(p,1,2,minutes); break;
+          case 'S': ok=readDigits(p,1,2,seconds); break;
+          case 'b':
+            ok=false;
+            if (strlen(p)>=3)
+              for (month=1; month<=12; ++month)
+                if (equal(p, p+3, months[month-1],
+                          [](char x, char y) {return tolower(static_cast<unsigned char>(x))==y;}))
+                  {
+                    p+=3;
+                    ok=true;
+                    break;
+                  }
+            break;
+          }
+        if (!ok) return false;
+      }
+    if (*p || year<1400 || year>9999 || month<1 || month>12 || day<1 ||
+        day>gregorian_calendar::end_of_month_day(year,month) ||
+        hours>23 || minutes>59 || seconds>59)
+      return false;
+    t=ptime(date(year,month,day),time_duration(hours,minutes,seconds));
+    return true;
+  }
   
   void XVector::push_back(const std::string& s)
   {
     if (pushTemplate.dimension()!=dimension)
       pushTemplate=AnyVal(dimension);
-    V::push_back(pushTemplate(s));
+    push_back(pushTemplate(s));
+  }
+
+  namespace
+  {
+    /// Pooled strings are stored in fixed size chunks that are never
+    /// moved, so lookups need no lock - an id is only handed out
+    /// after its string has been stored. Chunks are reached through a
+    /// two level table, whose second level tables and chunks are
+    /// allocated as the pool grows.
+    class StringPool
+    {
+      static constexpr unsigned chunkBits=12, tableBits=10;
+      static constexpr size_t chunkSize=size_t(1)<<chunkBits;
+      static constexpr size_t tableSize=size_t(1)<<tableBits;
+      static constexpr size_t maxStrings=size_t(1)<<32;
+      struct Table {atomic<string*> chunks[tableSize]={};};
+      mutex poolMutex;
+      unordered_map<string_view,uint32_t> ids;
+      atomic<Table*> tables[size_t(1)<<(32-chunkBits-tableBits)]={};
+      atomic<size_t> numStrings{0};
+      /// sort order of the first count pooled strings
+      struct RankTable
+      {
+        size_t count;
+        unique_ptr<uint32_t[]> rank;
+      };
+      atomic<const RankTable*> ranks{nullptr};
+      const RankTable* rebuildRanks();
+    public:
+      StringPool() {intern("");} // id 0 is the empty string
+      uint32_t intern(const string& x) {
+        lock_guard<mutex> lock(poolMutex);
+        auto i=ids.find(x);
+        if (i!=ids.end()) return i->second;
+        if (numStrings>=maxStrings)
+          throw runtime_error("string label pool exhausted");
+        auto& table=tables[numStrings>>(chunkBits+tableBits)];
+        if (!table.load(memory_order_relaxed))
+          table.store(new Table{}, memory_order_release);
+        auto& chunk=table.load(memory_order_relaxed)->chunks[(numStrings>>chunkBits)&(tableSize-1)];
+        if (!chunk.load(memory_order_relaxed))
+          chunk.store(new string[chunkSize], memory_order_release);
+        auto& s=chunk.load(memory_order_relaxed)[numStrings&(chunkSize-1)];
+        s=x;
+        ids.emplace(s,numStrings);
+        return numStrings++;
+      }
+      const string& lookup(uint32_t id) const
+      {
+        auto table=tables[id>>(chunkBits+tableBits)].load(memory_order_acquire);
+        auto chunk=table->chunks[(id>>chunkBits)&(tableSize-1)].load(memory_order_acquire);
+        return chunk[id&(chunkSize-1)];
+      }
+      bool less(uint32_t x, uint32_t y)
+      {
+        auto r=ranks.load(memory_order_acquire);
+        auto newest=max(x,y);
+        if (!r || newest>=r->count)
+          {
+            // rebuilding once the pool has doubled amortises the
+            // cost of ranking over the strings interned
+            if (numStrings.load(memory_order_relaxed)>=2*(r? r->count: 0))
+              r=rebuildRanks();
+            if (!r || newest>=r->count)
+              return lookup(x)<lookup(y);
+          }
+        return r->rank[x]<r->rank[y];
+      }
+    };
+
+    const StringPool::RankTable* StringPool::rebuildRanks()
+    {
+      lock_guard<mutex> lock(poolMutex);
+      auto r=ranks.load(memory_order_relaxed);
+      if (r && numStrings<2*r->count) return r; // another thread got here first
+      vector<uint32_t> order(numStrings);
+      iota(order.begin(), order.end(), 0);
+      sort(order.begin(), order.end(), [this](uint32_t x, uint32_t y) {return lookup(x)<lookup(y);});
+      auto newRanks=new RankTable{order.size(), unique_ptr<uint32_t[]>(new uint32_t[order.size()])};
+      for (size_t i=0; i<order.size(); ++i)
+        newRanks->rank[order[i]]=i;
+      // superseded tables are not freed, as other threads may still
+      // be reading them. They total less than the current table.
+      ranks.store(newRanks, memory_order_release);
+      return newRanks;
+    }
+
+    // never destroyed, as labels may outlive static destructors
+    StringPool& stringPool() {
+      static auto pool=new StringPool;
+      return *pool;
+    }
+  }
+
+  uint32_t InternedString::intern(const string& x)
+  {return x.empty()? 0: stringPool().intern(x);}
+  
+  const string& InternedString::lookup(uint32_t id)
+  {return stringPool().lookup(id);}
+
+  bool InternedString::less(uint32_t x, uint32_t y)
+  {return stringPool().less(x,y);}
+  
+  uint64_t LabelIndex::state(const vector<any>& labels) const
+  {
+    uint64_t r=generation;
+    r=r*0x9e3779b97f4a7c15ULL+labels.size();
+    r=r*0x9e3779b97f4a7c15ULL+reinterpret_cast<uintptr_t>(labels.data());
+    return r? r: 1; // 0 represents an unbuilt table
+  }
+  
+  size_t LabelIndex::find(const vector<any>& labels, const any& label)
+  {
+    static const size_t empty=~size_t(0);
+    auto current=state(labels);
+    if (builtFor!=current)
+      {
+        lock_guard<mutex> lock(buildMutex);
+        if (builtFor!=current) // in case another thread got here first
+          {
+            // table size is a power of 2, at most half full
+            size_t tableSize=2;
+            while (tableSize<2*labels.size()) tableSize*=2;
+            slots.assign(tableSize, empty);
+            for (size_t i=0; i<labels.size(); ++i)
+              for (size_t h=labels[i].hash();; ++h)
+                {
+                  auto& slot=slots[h&(tableSize-1)];
+                  if (slot==empty) {slot=i; break;}
+                  if (labels[slot]==labels[i]) break; // retain first occurrence
+                }
+            builtFor=current;
+          }
+      }
+    for (size_t h=label.hash();; ++h)
+      {
+        auto slot=slots[h&(slots.size()-1)];
+        if (slot==empty) return labels.size();
+        if (labels[slot]==label) return slot;
+      }
+  }
+
+  size_t LabelIndex::hash(const vector<any>& labels)
+  {
+    auto current=state(labels);
+    if (hashedFor.load(memory_order_acquire)!=current)
+      {
+        size_t h=labels.size();
+        for (auto& i: labels)
+          h=hashCombine(h, i.hash());
+        labelsHash.store(h, memory_order_relaxed);
+        hashedFor.store(current, memory_order_release);
+        return h;
+      }
+    return labelsHash.load(memory_order_relaxed);
   }
 
   void AnyVal::setDimension(const Dimension& dim)
@@ -92,36 +379,53 @@ namespace civita
         if (auto pq=dim.units.find("%Q"); pq!=string::npos)
           {
             timeType=quarter;
-            extract.setPattern(dim.units,pq);
+            parse.compile(dim.units);
+            // the extractor only handles %Y years
+            if (!parse.valid() || dim.units.find("%y")==string::npos)
+              extract.setPattern(dim.units,pq);
             return;
           }
-        // handle date formats with any combination of %Y, %m, %d, %H, %M, %S
-        // handle dates with 1 or 2 digits see Ravel ticket #35.
-        // Delegate to std::time_facet if time fields abut or more complicated formatting is requested
-        static regex nonStandardDateTimes{"%[^mdyYHMS]|%[mdyYHMS]%[mdyYHMS]"};
-        smatch match;
-        if (!regex_search(dim.units, match,nonStandardDateTimes)) 
-          {
-            timeType=regular;
-            static regex thisTimeFormat{"%([mdyYHMS])"};
-            for (string formatStr=dim.units.empty()? "%Y %m %d %H %M %S": dim.units;
-                 regex_search(formatStr, match, thisTimeFormat);
-                 formatStr=match.suffix())
-              {format.push_back(match.str(1)[0]);}
-            return;
-          }
-        timeType=time_input_facet;
-        return;
+        {
+          // handle date formats with any combination of %Y, %m, %d, %H, %M, %S
+          // handle dates with 1 or 2 digits see Ravel ticket #35.
+          // Delegate to std::time_facet if time fields abut or more complicated formatting is requested
+          static const char regularFields[]="mdyYHMS";
+          auto isRegularField=[&](size_t i)
+          {return i<dim.units.size() && dim.units[i] && strchr(regularFields, dim.units[i]);};
+          bool regularFormat=true;
+          for (size_t i=0; regularFormat && i+1<dim.units.size(); ++i)
+            if (dim.units[i]=='%')
+              regularFormat=isRegularField(++i) && !(dim.units[i+1]=='%' && isRegularField(i+2));
+          if (regularFormat)
+            {
+              timeType=regular;
+              string formatStr=dim.units.empty()? "%Y %m %d %H %M %S": dim.units;
+              format.clear();
+              for (size_t i=0; i+1<formatStr.size(); ++i)
+                if (formatStr[i]=='%' && formatStr[i+1] && strchr(regularFields, formatStr[i+1]))
+                  format.push_back(formatStr[++i]);
+              return;
+            }
+          timeType=time_input_facet;
+          parse.compile(dim.units);
+          return;
+        }
       }
   }
 
   any AnyVal::constructAnyFromQuarter(const std::string& s) const
   {
-    // year quarter format expected. Takes the first %Y (or
-    // %y) and first %Q for year and quarter
-    // respectively. Everything else is passed to regex, which
+    // year quarter format expected. Exact matches are handled by
+    // parse, which also handles %y.
+    ptime t;
+    if (parse.valid() && parse(s, t))
+      return t;
+    if (parse.valid() && dim.units.find("%y")!=string::npos)
+      throw InvalidDate(s, dim.units);
+    // Otherwise takes the first %Y and first %Q for year and quarter
+    // respectively. Everything else is matched literally, ignoring
+    // surrounding whitespace, or failing that, passed to regex, which
     // can be used to match complicated patterns.
-    string pattern;
     static greg_month quarterMonth[]={Jan,Apr,Jul,Oct};
     int year, quarter;
     extract(s,year,quarter);
@@ -133,8 +437,6 @@ namespace civita
   // handle date formats with any combination of %Y, %m, %d, %H, %M, %S
   any AnyVal::constructAnyFromRegular(const std::string& s) const
   {
-    smatch val;
-    static regex valParser{"(\\d+)"};
     int day=1, month=1, year=0, hours=0, minutes=0, seconds=0;
     size_t i=0;
     for (auto ss=s.c_str(); i<format.size(); ++i)
@@ -178,10 +480,12 @@ namespace civita
           case regular: return constructAnyFromRegular(s);
           case time_input_facet:
             {
-              // default case - delegate to std::time_input_facet
+              ptime pt(not_a_date_time);
+              if (parse.valid() && parse(s, pt))
+                return pt;
+              // otherwise delegate to std::time_input_facet
               istringstream is(s);
               is.imbue(locale(is.getloc(), new boost::posix_time::time_input_facet(dim.units)));
-              ptime pt(not_a_date_time);
               is>>pt;
               if (pt.is_special())
                 throw InvalidDate(s, dim.units);
@@ -215,10 +519,10 @@ namespace civita
           return x.string<y.string? -r: r;
         }
       case Dimension::value:
-        return x.value-y.value;
+        return x.asValue()-y.asValue();
       case Dimension::time:
         {
-          auto d=x.time-y.time;
+          auto d=x.asTime()-y.asTime();
           auto cutoff=hours(1000000);
           if (d<cutoff && d>-cutoff) // arbitrary cutoff, but well below overflow - million hours = a bit over a century
             return 1e-9*d.total_nanoseconds();
@@ -242,12 +546,12 @@ namespace civita
     switch (v.type)
       {
       case Dimension::string: return v.string;
-      case Dimension::value: return to_string(v.value);
+      case Dimension::value: return to_string(v.asValue());
       case Dimension::time:
         {
           string::size_type pq;
           if (format.empty())
-            return to_iso_extended_string(v.time);
+            return to_iso_extended_string(v.asTime());
           if ((pq=format.find("%Q"))!=string::npos)
             {
               auto pY=format.find("%Y");
@@ -260,7 +564,7 @@ namespace civita
                 if (sformat[i-1]=='%' && (sformat[i]=='Q' || sformat[i]=='Y'))
                   sformat[i]='d';
               char result[100];
-              auto tm=to_tm(v.time.date());
+              auto tm=to_tm(v.asTime().date());
               if (pq<pY)
                 return formatString(sformat,tm.tm_mon/3+1, tm.tm_year+1900);
               return formatString(sformat, tm.tm_year+1900, tm.tm_mon/3+1);
@@ -270,7 +574,7 @@ namespace civita
               unique_ptr<time_facet> facet(new time_facet(format.c_str()));
               ostringstream os;
               os.imbue(locale(os.getloc(), facet.release()));
-              os<<v.time;
+              os<<v.asTime();
               return os.str();
             }
         }
@@ -282,10 +586,11 @@ namespace civita
   string XVector::timeFormat() const
   {
     if (dimension.type!=Dimension::time || empty()) return "";
+    if (front().type!=Dimension::time || back().type!=Dimension::time) return "%s";
     static const auto day=hours(24);
     static const auto month=day*30;
     static const auto year=day*365;
-    auto f=front().time, b=back().time;
+    auto f=front().asTime(), b=back().asTime();
     if (f>b) std::swap(f,b);
     auto dt=b-f;
     if (dt > year*5)
@@ -321,7 +626,8 @@ namespace civita
         break;
       }
 
-    for (auto& i: *this)
+    labelIndex.invalidate();
+    for (auto& i: static_cast<V&>(*this))
       i=anyVal(dimension, str(i));
     assert(checkThisType());
   }
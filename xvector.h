@@ -21,7 +21,10 @@
 #define CIVITA_XVECTOR_H
 #include "dimension.h"
 #include <boost/date_time.hpp>
+#include <atomic>
+#include <memory>
 #include <vector>
+#include <mutex>
 #include <regex>
 #include <initializer_list>
 
@@ -34,24 +37,59 @@ namespace civita
   // internal class for extracting quarter/year data
   class Extractor
   {
-    std::regex pattern;
+    // text preceding, between and following the year and quarter fields
+    std::string prefix, infix, suffix;
+    std::size_t width1=4, width2=1; // number of digits in each field
     bool swapVars=false;
-    std::string rePat;
+    std::string format, rePat;
+    /// fallback for data not matching the format literally, or null
+    /// if \a rePat is not a valid regular expression
+    std::shared_ptr<const std::regex> pattern;
 #ifdef CLASSDESC
     CLASSDESC_ACCESS(Extractor);
 #endif
   public:
-    /// initialise regex pattern
+    /// initialise pattern
     /// @param fmt dimenion unit string describing this time type
     /// @param pq location of %Q in fmt string
     void setPattern(const std::string& fmt, size_t pq);
 
-    /// Extract year and date values from \a data
+    /// Extract year and date values from \a data. The text other
+    /// than the first %Y and %Q fields is matched literally, and if
+    /// that fails, is passed to regex, which can be used to match
+    /// complicated patterns.
     /// If swapVars is true, then var1 is quarter, var2 is year, otherwise vice-versa
     void operator()(const std::string& data, int& var1, int& var2) const;
   };
   
 
+  /// internal class: a time format compiled into a sequence of fields
+  /// and literal text, for parsing times without regular expressions
+  /// or locales. Supports %Y, %y, %m, %d, %H, %M, %S, %b, %Q and
+  /// %%. %y is a 2 digit year, with 69-99 taken as 1969-1999, and 00-68
+  /// as 2000-2068. %Q is a quarter (1-4), setting the month to the
+  /// quarter's first.
+  class TimeParser
+  {
+    struct Token
+    {
+      char field; // format specifier, or 0 for literal text
+      std::string literal;
+    };
+    std::vector<Token> tokens;
+    bool m_valid=false;
+#ifdef CLASSDESC
+    CLASSDESC_ACCESS(TimeParser);
+#endif
+  public:
+    /// compile \a format, setting valid() to false if \a format
+    /// contains unsupported specifiers
+    void compile(const std::string& format);
+    bool valid() const {return m_valid;}
+    /// parse \a data into \a t
+    /// @return false if \a data does not exactly match the format
+    bool operator()(const std::string& data, boost::posix_time::ptime& t) const;
+  };
   
   /// convert string rep to an any rep
   ///two phase caching data independent computation for ptime conversion 
@@ -74,6 +112,7 @@ namespace civita
     any constructAnyFromQuarter(const std::string&) const;
     any constructAnyFromRegular(const std::string&) const;
     Extractor extract;
+    TimeParser parse; ///< used before falling back to time_input_facet or extract
   };
 
   /// convert string rep to an any rep
@@ -95,6 +134,45 @@ namespace civita
     {return std::lexicographical_compare(x.begin(),x.end(),y.begin(),y.end(),AnyLess());}
   };
     
+  /// mixes hash \a h into \a seed, as per boost::hash_combine
+  inline std::size_t hashCombine(std::size_t seed, std::size_t h)
+  {return seed ^ (h + std::size_t(0x9e3779b97f4a7c15ULL) + (seed<<12) + (seed>>4));}
+  
+  /// internal class: open addressing hash table mapping labels to
+  /// their positions in a vector of labels, built on first use, along
+  /// with a hash of the labels. Copies are empty, and rebuilt when
+  /// next needed.
+  ///
+  /// The table and hash are validated lazily against a generation count,
+  /// incremented by invalidate(), and the size and address of the
+  /// labels, so resizing through a std::vector<any> reference is also
+  /// detected. XVector only hands out const references to its labels,
+  /// so labels can only be modified in place by casting to
+  /// std::vector<any>, which is not detected.
+  class LabelIndex
+  {
+    std::vector<std::size_t> slots; // positions of labels, or ~0 if empty
+    std::size_t generation=0;
+    std::atomic<std::uint64_t> builtFor{0}; // state of the labels the table was built for
+    std::mutex buildMutex;
+    std::atomic<std::size_t> labelsHash{0};
+    std::atomic<std::uint64_t> hashedFor{0}; // state of the labels labelsHash was computed for
+    std::uint64_t state(const std::vector<any>& labels) const;
+#ifdef CLASSDESC
+    CLASSDESC_ACCESS(LabelIndex);
+#endif
+  public:
+    LabelIndex()=default;
+    LabelIndex(const LabelIndex&) {}
+    LabelIndex& operator=(const LabelIndex&) {invalidate(); return *this;}
+    /// mark the table as needing rebuilding. Not thread safe with respect to find.
+    void invalidate() {++generation;}
+    /// position of the first occurrence of \a label in \a labels, or labels.size() if absent
+    std::size_t find(const std::vector<any>& labels, const any& label);
+    /// hash of \a labels
+    std::size_t hash(const std::vector<any>& labels);
+  };
+  
   /// labels describing the points along dimensions. These can be strings (text type), time values (boost::posix_time type) or numerical values (double)
   class XVector: public NamedDimension, public std::vector<any>
   {
@@ -110,7 +188,43 @@ namespace civita
     bool operator==(const XVector& x) const {return static_cast<const V&>(*this)==x;}
     void push_back(const std::string&);
     void push_back(const char* x) {push_back(std::string(x));}
-    using V::push_back;
+    void push_back(const any& x) {labelIndex.invalidate(); V::push_back(x);}
+    /// position of the first occurrence of \a label, or size() if not
+    /// present. Uses a hash table, built on first use and rebuilt
+    /// after this is modified.
+    std::size_t position(const any& label) const
+    {return labelIndex.find(*this, label);}
+    /// hash of the labels, cached until this is next modified
+    std::size_t labelHash() const {return labelIndex.hash(*this);}
+
+    // element access is read only, so that reads never invalidate the
+    // label index. Use set() or the modifiers below to change labels.
+    const_reference operator[](size_type i) const {return V::operator[](i);}
+    const_reference at(size_type i) const {return V::at(i);}
+    const_reference front() const {return V::front();}
+    const_reference back() const {return V::back();}
+    const any* data() const {return V::data();}
+    const_iterator begin() const {return V::begin();}
+    const_iterator end() const {return V::end();}
+    const_reverse_iterator rbegin() const {return V::rbegin();}
+    const_reverse_iterator rend() const {return V::rend();}
+    /// replace the \a i-th label with \a x
+    void set(size_type i, const any& x) {labelIndex.invalidate(); V::operator[](i)=x;}
+    template <class... A> decltype(auto) emplace_back(A&&... a)
+    {labelIndex.invalidate(); return V::emplace_back(std::forward<A>(a)...);}
+    template <class... A> iterator emplace(A&&... a)
+    {labelIndex.invalidate(); return V::emplace(std::forward<A>(a)...);}
+    template <class... A> iterator insert(A&&... a)
+    {labelIndex.invalidate(); return V::insert(std::forward<A>(a)...);}
+    template <class... A> iterator erase(A&&... a)
+    {labelIndex.invalidate(); return V::erase(std::forward<A>(a)...);}
+    template <class... A> void assign(A&&... a)
+    {labelIndex.invalidate(); V::assign(std::forward<A>(a)...);}
+    template <class... A> void resize(A&&... a)
+    {labelIndex.invalidate(); V::resize(std::forward<A>(a)...);}
+    void pop_back() {labelIndex.invalidate(); V::pop_back();}
+    void clear() {labelIndex.invalidate(); V::clear();}
+    void swap(V& x) {labelIndex.invalidate(); V::swap(x);}
     /// best time format given range of data for plot xticks and spreadsheet labels
     std::string timeFormat() const;
     /// rewrites the labels according to dimension
@@ -139,6 +253,7 @@ namespace civita
   private:
     /// cached AnyVal template for push operations
     AnyVal pushTemplate;
+    mutable LabelIndex labelIndex;
   };
 
 }
@@ -180,6 +295,58 @@ namespace classdesc_access
   template <> struct access_random_init<civita::Extractor>:
     public classdesc::NullDescriptor<classdesc::random_init_t> {};
 }
+
+// TimeParser is compiled from the dimension's units, so is not serialised.
+#define CLASSDESC_pack___civita__TimeParser
+#define CLASSDESC_unpack___civita__TimeParser
+#define CLASSDESC_json_pack___civita__TimeParser
+#define CLASSDESC_json_unpack___civita__TimeParser
+#define CLASSDESC_xml_pack___civita__TimeParser
+#define CLASSDESC_xml_unpack___civita__TimeParser
+#define CLASSDESC_random_init___civita__TimeParser
+namespace classdesc_access
+{
+  template <> struct access_pack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::pack_t> {};
+  template <> struct access_unpack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::unpack_t> {};
+  template <> struct access_json_pack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::json_pack_t> {};
+  template <> struct access_json_unpack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::json_unpack_t> {};
+  template <> struct access_xml_pack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::xml_pack_t> {};
+  template <> struct access_xml_unpack<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::xml_unpack_t> {};
+  template <> struct access_random_init<civita::TimeParser>:
+    public classdesc::NullDescriptor<classdesc::random_init_t> {};
+}
+
+// LabelIndex is a cache, rebuilt on demand, so is not serialised.
+#define CLASSDESC_pack___civita__LabelIndex
+#define CLASSDESC_unpack___civita__LabelIndex
+#define CLASSDESC_json_pack___civita__LabelIndex
+#define CLASSDESC_json_unpack___civita__LabelIndex
+#define CLASSDESC_xml_pack___civita__LabelIndex
+#define CLASSDESC_xml_unpack___civita__LabelIndex
+#define CLASSDESC_random_init___civita__LabelIndex
+namespace classdesc_access
+{
+  template <> struct access_pack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::pack_t> {};
+  template <> struct access_unpack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::unpack_t> {};
+  template <> struct access_json_pack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::json_pack_t> {};
+  template <> struct access_json_unpack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::json_unpack_t> {};
+  template <> struct access_xml_pack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::xml_pack_t> {};
+  template <> struct access_xml_unpack<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::xml_unpack_t> {};
+  template <> struct access_random_init<civita::LabelIndex>:
+    public classdesc::NullDescriptor<classdesc::random_init_t> {};
+}
 #endif
 
 #endif